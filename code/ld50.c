@@ -19,6 +19,10 @@
 #include <emscripten.h>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
@@ -45,11 +49,30 @@ typedef u32 b32;
 #define SMALL_FONT_SIZE 16
 #define MAX_ENTITY_COUNT 512
 #define MAX_ENTITY_PART_COUNT 255
+#define ENTITY_PART_NONE UINT16_MAX
+#define PART_BLOCK_ORDER_COUNT 9
+#define MAX_PART_BLOCK_SIZE (1 << (PART_BLOCK_ORDER_COUNT - 1))
+#define MAX_POOLED_PART_COUNT (MAX_ENTITY_COUNT * 32)
+#define PART_BLOCK_NONE UINT16_MAX
 #define MAX_PARTICLE_COUNT (1 << 15)
 #define MAX_SOUND_COUNT (1 << 15)
+#define SOUND_COMMAND_QUEUE_SIZE (1 << 15)
+#define SINE_TABLE_BITS 10
+#define SINE_TABLE_SIZE (1 << SINE_TABLE_BITS)
 #define AUDIO_SAMPLE_COUNT 1024
+#define FFT_SIZE AUDIO_SAMPLE_COUNT
+#define SPECTRUM_BIN_COUNT (FFT_SIZE / 4)
 #define TUNNEL_SEGMENT_COUNT 1024
 #define TUNNEL_SEGMENT_THICKNESS 10
+#define PROFILE_HISTORY_COUNT 240
+#define COLLISION_GRID_CELL_SIZE 64
+#define COLLISION_GRID_WIDTH ((WINDOW_WIDTH + COLLISION_GRID_CELL_SIZE - 1) / COLLISION_GRID_CELL_SIZE)
+#define COLLISION_GRID_HEIGHT ((WINDOW_HEIGHT + COLLISION_GRID_CELL_SIZE - 1) / COLLISION_GRID_CELL_SIZE)
+#define MAX_COLLISION_GRID_ENTRY_COUNT (1 << 16)
+#define MAX_COLLISION_CANDIDATE_COUNT 512
+#define MAX_JOB_WORKER_COUNT 16
+#define ENTITY_JOB_CHUNK_SIZE 16
+#define PARTICLE_JOB_CHUNK_SIZE 1024
 
 #define ARRAY_COUNT(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -225,9 +248,26 @@ scale_v2i(struct v2i a, s32 s)
 	return result;
 }
 
+/* NOTE(omid): One independent xorshift stream. The game, every entity and
+ * every sound voice own one, and each particle emitter derives its own
+ * from the game seed, the frame and its index, so nothing depends on how
+ * many numbers some other update drew before it. */
+struct random_series {
+	u32 state;
+};
+
+struct entity_handle {
+	u16 slot;
+	u16 generation;
+};
+
+struct entity_slot {
+	u16 generation;
+	u16 entity_index;
+};
+
 struct entity_part_owner {
-	u32 entity_id;
-	u32 entity_index;
+	struct entity_handle entity;
 	u16 particle_index;
 	u16 entity_part_index;
 	b16 direct;
@@ -241,6 +281,8 @@ struct entity_part {
 	u16 height;
 	u16 color;
 	u16 parent_index;
+	u16 first_child;
+	u16 next_sibling;
 	u16 depth;
 	b8 disposed;
 	b8 die_at_screen_edge: 2;
@@ -275,16 +317,72 @@ enum particle_type {
 	PARTICLE_FIREBALL = (1 << 5)
 };
 
+enum particle_flag {
+	PARTICLE_FLAG_DISPOSED           = (1 << 0),
+	PARTICLE_FLAG_DIE_AT_SCREEN_EDGE = (1 << 1),
+	PARTICLE_FLAG_IMMUNE_TO_WALL     = (1 << 2),
+	PARTICLE_FLAG_PASSTHROUGH        = (1 << 3),
+	/* NOTE(omid): Set for the particles that are being moved this frame,
+	 * i.e. were alive after the expiry check. */
+	PARTICLE_FLAG_MOVING             = (1 << 4),
+	/* NOTE(omid): Set when the position before this frame's move
+	 * overlaps a tunnel wall. */
+	PARTICLE_FLAG_IN_WALL            = (1 << 5)
+};
+
+#define PARTICLE_INDEX_NONE UINT32_MAX
+
+/* NOTE(omid): Cold per-particle data, only touched on spawn, hits and
+ * rendering. */
 struct particle {
-	struct entity_part part;
-	enum particle_type type: 16;
-	u16 owner_index;
-	u32 owner_id;
 	u16 owner_part_index;
-	u16 pad_;
+	u16 color;
+	struct entity_handle owner;
 	f32 spawn_t;
-	f32 expiration_t;
-	u32 pad2_;
+	f32 mass;
+	f32 angle;
+	u16 dmg;
+	u16 pad_;
+};
+
+/* NOTE(omid): Particles as parallel arrays, the same index in every
+ * array is the same particle. The physics kernels only stream through
+ * the hot arrays at the top. */
+struct particle_store {
+	u32 count;
+	f32 p_x[MAX_PARTICLE_COUNT];
+	f32 p_y[MAX_PARTICLE_COUNT];
+	f32 v_x[MAX_PARTICLE_COUNT];
+	f32 v_y[MAX_PARTICLE_COUNT];
+	f32 a_x[MAX_PARTICLE_COUNT];
+	f32 a_y[MAX_PARTICLE_COUNT];
+	f32 next_p_x[MAX_PARTICLE_COUNT];
+	f32 next_p_y[MAX_PARTICLE_COUNT];
+	f32 expiration_t[MAX_PARTICLE_COUNT];
+	u32 flags[MAX_PARTICLE_COUNT];
+	u16 type[MAX_PARTICLE_COUNT];
+	u16 width[MAX_PARTICLE_COUNT];
+	u16 height[MAX_PARTICLE_COUNT];
+
+	struct particle info[MAX_PARTICLE_COUNT];
+};
+
+/* NOTE(omid): Drawn through the same quad buffer as particles. */
+#define MAX_FX_PARTICLE_COUNT MAX_PARTICLE_COUNT
+#define FX_PARTICLE_TTL 60
+
+/* NOTE(omid): Purely visual particles (debris, fireball trails). They
+ * only move and fade, never collide with entities and die on the tunnel
+ * walls and the screen edge. Velocity grows by accel along its own
+ * direction each frame, up to the same speed limit as particles. */
+struct fx_particle {
+	struct v2 p;
+	struct v2 v;
+	f32 accel;
+	u8 ttl;
+	u8 color;
+	u8 size;
+	u8 angle;
 };
 
 enum entity_type {
@@ -294,10 +392,30 @@ enum entity_type {
 	ENTITY_LIGHTNING   = (1 << 2)
 };
 
+struct part_block_link {
+	u16 next;
+	u16 prev;
+	/* NOTE(omid): order + 1 while the block is on a free list, 0 otherwise. */
+	u8 free_order;
+	u8 pad_;
+};
+
+/* NOTE(omid): Buddy allocator for entity parts. Blocks hold a power of two
+ * parts, from 1 up to MAX_PART_BLOCK_SIZE, and merge with their buddy when
+ * freed so the arena doesn't fragment across levels. */
+struct entity_part_pool {
+	struct entity_part parts[MAX_POOLED_PART_COUNT];
+	struct part_block_link links[MAX_POOLED_PART_COUNT];
+	u16 free_blocks[PART_BLOCK_ORDER_COUNT];
+	u16 pad_;
+	u32 allocated_part_count;
+};
+
 struct entity {
-	u32 id;
+	struct entity_handle handle;
 	u32 index;
 	u32 seed;
+	struct random_series random;
 	u32 type;
 	u8 part_count;
 	b8 internal_collisions: 1;
@@ -305,13 +423,12 @@ struct entity {
 	b8 suspended_for_frame: 1;
 	b8 expire: 1;
 	u32 pad: 20;
-	u32 pad_;
-	struct entity_part parts[MAX_ENTITY_PART_COUNT];
+	u32 part_block_order;
+	struct entity_part *parts;
 
 	struct v2 target;
 	f32 pull_of_target;
-	u32 target_entity_index;
-	u32 target_entity_id;
+	struct entity_handle target_entity;
 	b32 has_target;
 	f32 next_target_check_t;
 	f32 spawn_t;
@@ -320,8 +437,8 @@ struct entity {
 
 	f32 z;
 
-	u32 from_id;
-	u32 to_id;
+	struct entity_handle from;
+	struct entity_handle to;
 	u16 from_part_index;
 	u16 to_part_index;
 };
@@ -345,13 +462,50 @@ struct sound {
 	b8 fadeout: 1;
 	b8 echo: 1;
 	b8 once: 1;
-	u16 pad: 10;
+	b8 silenced: 1;
+	u16 pad: 9;
 	u16 tag;
+	u32 phase;
+	u32 phase_step;
+	struct random_series random;
 	f32 play_begin;
 	f32 fadeout_begin;
 	f32 fadeout_end;
 };
 
+enum sound_command_type {
+	SOUND_COMMAND_START
+};
+
+struct sound_command {
+	enum sound_command_type type: 8;
+	enum waveform_type waveform: 8;
+	b8 once;
+	u16 freq;
+	f32 amp;
+};
+
+/* NOTE(omid): Single producer (game thread), single consumer (audio
+ * callback). The audio thread owns sounds[]; everyone else talks to it
+ * through this ring. 'read' is only written by the consumer and 'write'
+ * only by the producer. Stops and fades all come from the sequencer on
+ * the audio thread, so the game thread only ever starts sounds. */
+struct sound_command_queue {
+	struct sound_command commands[SOUND_COMMAND_QUEUE_SIZE];
+	SDL_atomic_t read;
+	SDL_atomic_t write;
+	u32 dropped_count;
+	u32 pad_;
+};
+
+/* NOTE(omid): W_N^k = cos_table[k] - i * sin_table[k]. The half-size
+ * complex transform inside real_fft uses every other entry. */
+struct fft_tables {
+	f32 cos_table[FFT_SIZE / 2];
+	f32 sin_table[FFT_SIZE / 2];
+	u16 bit_reverse[FFT_SIZE / 2];
+};
+
 enum game_event_type {
 	GAME_EVENT_NONE,
 	GAME_EVENT_SEED_TOUCH_WATER,
@@ -391,13 +545,30 @@ struct track_event {
 	uint8_t d;
 };
 
+enum track_note_type {
+	TRACK_NOTE_OFF,
+	TRACK_NOTE_ON,
+	/* NOTE(omid): Note-on with an explicit status byte, plays a noise click. */
+	TRACK_NOTE_ON_ACCENT
+};
+
+struct track_note {
+	u32 sample_offset;
+	enum track_note_type type: 8;
+	u8 note;
+	u8 velocity;
+	u8 pad_;
+};
+
+/* NOTE(omid): Tracks are compiled at load into note-on/off records with
+ * sample offsets from the start of the loop; the mixer plays them at the
+ * exact sample they are due. */
 struct track {
-	struct track_event *events;
-	u32 event_count;
-	u32 current_event;
-	f32 last_event_time;
-	u8 last_event_status;
-	u32 tempo_inverse_scale: 24;
+	struct track_note *notes;
+	u32 note_count;
+	u32 current_note;
+	u64 loop_start_sample;
+	u64 loop_sample_count;
 };
 
 struct tunnel_segment {
@@ -405,6 +576,16 @@ struct tunnel_segment {
 	u16 right;
 };
 
+#define TUNNEL_PROFILE_ROW_COUNT (WINDOW_HEIGHT / TUNNEL_SEGMENT_THICKNESS + 1)
+
+/* NOTE(omid): Rebuilt once a frame after the tunnel moves. Row k covers
+ * screen y in [k, k + 1) * TUNNEL_SEGMENT_THICKNESS and holds the free
+ * x range between the walls of the two segments that row touches. */
+struct tunnel_profile {
+	f32 min_x[TUNNEL_PROFILE_ROW_COUNT];
+	f32 max_x[TUNNEL_PROFILE_ROW_COUNT];
+};
+
 enum card_type {
 	REPAIR_CARD,
 	UPGRADE_HP_CARD,
@@ -420,18 +601,185 @@ struct card {
 	const char *name;
 };
 
+struct collision_grid_entry {
+	u16 entity_index;
+	u8 part_index;
+	u8 pad_;
+	u32 next;
+};
+
+struct collision_grid_rect {
+	u8 x0;
+	u8 y0;
+	u8 x1;
+	u8 y1;
+};
+
+struct collision_grid {
+	u32 cells[COLLISION_GRID_HEIGHT][COLLISION_GRID_WIDTH];
+	struct collision_grid_entry entries[MAX_COLLISION_GRID_ENTRY_COUNT];
+	u32 entry_count;
+	b32 overflowed;
+
+	u32 entity_count;
+	u8 binned_part_count[MAX_ENTITY_COUNT];
+	struct collision_grid_rect binned[MAX_ENTITY_COUNT][MAX_ENTITY_PART_COUNT];
+};
+
+#define MAX_SPAWN_COMMAND_COUNT 4096
+#define MAX_DAMAGE_COMMAND_COUNT 4096
+
+enum spawn_command_type {
+	SPAWN_COMMAND_EXPLOSION,
+	SPAWN_COMMAND_TRAIL
+};
+
+struct spawn_command {
+	u8 type;
+	u8 color;
+	u16 count;
+	struct entity_part_owner owner;
+	struct v2 p;
+};
+
+/* NOTE(omid): A particle hit on an entity part. Indices stay valid until
+ * the buffer is applied, nothing is removed before the next frame. */
+struct damage_command {
+	struct entity_part_owner owner;
+	u16 target_index;
+	u16 target_part_index;
+	u16 dmg;
+	u16 particle_type;
+};
+
+/* NOTE(omid): Spawns and hits recorded while a phase iterates the
+ * entities and particles, applied in order at the end of the phase.
+ * Disposal is already deferred: parts and particles are only flagged
+ * and begin_game_frame removes them. */
+struct sim_commands {
+	u32 spawn_count;
+	u32 damage_count;
+	struct spawn_command spawns[MAX_SPAWN_COMMAND_COUNT];
+	struct damage_command damages[MAX_DAMAGE_COMMAND_COUNT];
+
+	/* NOTE(omid): Commands that did not fit, and spawns that found the
+	 * particle, FX or entity store full, since the start of the game. */
+	u32 dropped_command_count;
+	u32 dropped_spawn_count;
+};
+
+/* NOTE(omid): A particle touching an entity part, found by the parallel
+ * collision pass without writing anything, and applied in particle order
+ * by resolve_particle_hits. 'p' is the particle's position after the
+ * contact. 'order' keeps a particle's contacts in the order they were
+ * found. */
+#define MAX_PARTICLE_HIT_COUNT 4096
+
+enum particle_hit_flag {
+	PARTICLE_HIT_DAMAGE = (1 << 0),
+	PARTICLE_HIT_PUSH   = (1 << 1)
+};
+
+struct particle_hit {
+	u32 particle_index;
+	u32 order;
+	u16 target_index;
+	u16 target_part_index;
+	u32 flags;
+	struct v2 force;
+	struct v2 p;
+};
+
+/* NOTE(omid): One per job worker. */
+struct particle_hits {
+	u32 count;
+	b32 overflowed;
+	struct particle_hit hits[MAX_PARTICLE_HIT_COUNT];
+};
+
+enum profile_phase {
+	PROFILE_BEGIN_GAME_FRAME,
+	PROFILE_RUN_LEVEL_SCENARIO_CONTROL,
+	PROFILE_APPLY_USER_INPUT,
+	PROFILE_UPDATE_ENTITY_AI,
+	PROFILE_UPDATE_SPRING_PHYSICS,
+	PROFILE_UPDATE_NEWTONIAN_PHYSICS,
+	PROFILE_UPDATE_FX_PARTICLES,
+	PROFILE_PROCESS_TRIGGERED_EVENTS,
+	PROFILE_UPDATE_AUDIO,
+	PROFILE_SORT_BY_Z,
+	PROFILE_RENDER_TUNNEL,
+	PROFILE_RENDER_ENTITIES,
+	PROFILE_RENDER_PARTICLES,
+	PROFILE_RENDER_HUD,
+	PROFILE_RENDER_TEXT,
+	PROFILE_PHASE_COUNT
+};
+
+static const char *PROFILE_PHASE_NAMES[PROFILE_PHASE_COUNT] = {
+	"begin_game_frame",
+	"run_level_scenario_control",
+	"apply_user_input",
+	"update_entity_ai",
+	"update_spring_physics",
+	"update_newtonian_physics",
+	"update_fx_particles",
+	"process_triggered_events",
+	"update_audio",
+	"sort_by_z",
+	"render_tunnel",
+	"render_entities",
+	"render_particles",
+	"render_hud",
+	"render_text"
+};
+
+struct profiler {
+	u64 phase_begin[PROFILE_PHASE_COUNT];
+	u64 phase_ticks[PROFILE_PHASE_COUNT];
+	f32 history[PROFILE_HISTORY_COUNT][PROFILE_PHASE_COUNT];
+	u32 history_index;
+	b32 visible;
+	f64 ticks_to_ms;
+	FILE *csv;
+};
+
+/* NOTE(omid): Parts due to fire this frame as (entity index << 8) | part
+ * index, one buffer per job worker. Every part lives in the pool, so a
+ * buffer can't overflow. */
+#define MAX_FIRE_REQUEST_COUNT MAX_POOLED_PART_COUNT
+
+struct fire_requests {
+	u32 count;
+	u32 keys[MAX_FIRE_REQUEST_COUNT];
+};
+
 struct game_state {
 	struct entity entities[MAX_ENTITY_COUNT];
 	u32 entity_count;
 
+	struct entity_part_pool part_pool;
+
+	struct entity_slot entity_slots[MAX_ENTITY_COUNT];
+	u16 free_entity_slots[MAX_ENTITY_COUNT];
+	u32 free_entity_slot_count;
+	u32 entity_slot_high_water;
+
 	u32 entity_index_by_z[MAX_ENTITY_COUNT];
 
 	u32 last_played_track;
-	struct particle particles[MAX_PARTICLE_COUNT];
-	u32 particle_count;
+	struct particle_store particles;
+
+	struct fx_particle fx_particles[MAX_FX_PARTICLE_COUNT];
+	u32 fx_particle_count;
+
+	struct sim_commands commands;
 
-	u32 player_index;
-	u32 player_id;
+	struct fire_requests fire_requests[MAX_JOB_WORKER_COUNT];
+	u32 fire_order[MAX_FIRE_REQUEST_COUNT];
+	struct particle_hits particle_hits[MAX_JOB_WORKER_COUNT];
+
+	struct entity_handle player;
 
 	struct spawn_item spawn_bag[512];
 	u32 spawn_bag_count;
@@ -441,6 +789,10 @@ struct game_state {
 	f32 time;
 	f32 real_time;
 
+	/* NOTE(omid): Levels, cards, the tunnel and new entities' seeds. */
+	u32 seed;
+	struct random_series random;
+
 	f32 last_frame_real_time;
 
 	f32 last_level_end_t;
@@ -465,11 +817,15 @@ struct game_state {
 
 	struct sound sounds[MAX_SOUND_COUNT];
 	u32 sound_count;
+	/* NOTE(omid): Owned by the audio thread like sounds[]; seeds the
+	 * stream of each new voice. */
+	struct random_series audio_random;
+
+	struct sound_command_queue sound_commands;
 
 	struct game_event events[64];
 	u32 event_count;
 
-	u32 entity_id_seq;
 	u32 score;
 	u32 visible_score;
 	u32 pad_;
@@ -485,9 +841,12 @@ struct game_state {
 	f32 tunnel_difficulty;
 	struct card cards[3];
 
+	f32 sine_table[SINE_TABLE_SIZE + 1];
 	f32 last_audio_mix[AUDIO_SAMPLE_COUNT];
 	f32 audio_mix_sample[AUDIO_SAMPLE_COUNT];
 	f32 audio_mix_power;
+	f32 audio_spectrum[SPECTRUM_BIN_COUNT];
+	struct fft_tables fft_tables;
 
 	b32 waiting_for_spawn;
 
@@ -496,9 +855,13 @@ struct game_state {
 
 	struct track tracks[8];
 	u32 track_count;
+	u16 note_freq[128];
 
 	u32 current_tunnel_segment;
 	struct tunnel_segment tunnel_segments[TUNNEL_SEGMENT_COUNT];
+	struct tunnel_profile tunnel_profile;
+
+	struct collision_grid collision_grid;
 
 	f32 current_tunnel_depth;
 	f32 next_tunnel_depth;
@@ -508,6 +871,8 @@ struct game_state {
 
 	SDL_Texture *temp_texture;
 	/* u32 note_wave_number[128]; */
+
+	struct profiler profiler;
 };
 
 struct input_state
@@ -523,6 +888,8 @@ struct input_state
 	u8 speed_up;
 	u8 speed_down;
 
+	u8 toggle_profiler;
+
 	s8 dleft;
 	s8 dright;
 	s8 dup;
@@ -532,6 +899,12 @@ struct input_state
 
 	s8 dspeed_up;
 	s8 dspeed_down;
+
+	s8 dtoggle_profiler;
+
+	u8 mouse_buttons;
+	s16 mouse_x;
+	s16 mouse_y;
 };
 
 enum text_align
@@ -543,18 +916,58 @@ enum text_align
 
 
 
+static u32
+mix_random_seed(u32 x)
+{
+	/* NOTE(omid): lowbias32 finalizer, nearby seeds land far apart. */
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static struct random_series
+random_series_from_seed(u32 seed)
+{
+	struct random_series result;
+	result.state = mix_random_seed(seed);
+	if (!result.state)
+		result.state = 0x9e3779b9u;
+	return result;
+}
+
+static struct random_series
+random_series_for_stream(u32 seed, u32 stream)
+{
+	return random_series_from_seed(mix_random_seed(seed) ^ mix_random_seed(stream + 0x9e3779b9u));
+}
+
+static u32
+next_random_u32(struct random_series *series)
+{
+	/* NOTE(omid): xorshift32. */
+	u32 x = series->state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	series->state = x;
+	return x;
+}
+
 static s32
-random_int(s32 min, s32 max)
+random_int(struct random_series *series, s32 min, s32 max)
 {
-	s32 range = max - min;
-	return min + rand() % range;
+	u32 range = (u32)(max - min);
+	return min + (s32)(next_random_u32(series) % range);
 }
 
 static f32
-random_f32()
+random_f32(struct random_series *series)
 {
-	u32 r = (u32)(rand());
-	return (f32)r / (f32)RAND_MAX;
+	/* NOTE(omid): [0, 1), from the top 24 bits. */
+	return (f32)(next_random_u32(series) >> 8) * (1.0f / 16777216.0f);
 }
 
 static s32
@@ -581,12 +994,242 @@ max_u(u32 x, u32 y)
 	return x > y ? x : y;
 }
 
+/* NOTE(omid): A small work-stealing pool for parallel-for. The main thread
+ * is worker 0 and takes part in every job. A job's range is cut into
+ * chunks; each worker starts on its own contiguous share of them, taking
+ * from the front, and once that runs out steals from the back of the
+ * others'. Users write only to the items of their range or to the
+ * buffers of the worker running it, and reduce those in item order, so
+ * the outcome does not depend on the worker count or on who ran what. */
+#define MAX_JOB_CHUNK_COUNT UINT16_MAX
+
+typedef void job_range_function(void *data, u32 worker_index, u32 begin, u32 end);
+
+/* NOTE(omid): Next chunk in the low 16 bits, end in the high 16 bits, so
+ * the owner and thieves race on a single CAS. Padded to a cache line. */
+struct job_queue {
+	SDL_atomic_t chunks;
+	u8 pad_[60];
+};
+
+struct job_worker {
+	struct job_system *jobs;
+	u32 index;
+	SDL_Thread *thread;
+};
+
+struct job_system {
+	u32 worker_count;
+	struct job_worker workers[MAX_JOB_WORKER_COUNT];
+	SDL_sem *start;
+	SDL_sem *done;
+	b32 quit;
+
+	job_range_function *function;
+	void *data;
+	u32 count;
+	u32 chunk_size;
+
+	struct job_queue queues[MAX_JOB_WORKER_COUNT];
+};
+
+static struct job_system job_system;
+
+static b32
+take_job_chunk(struct job_queue *queue, b32 from_back, u32 *chunk)
+{
+	for (;;) {
+		s32 old_chunks = SDL_AtomicGet(&queue->chunks);
+		u32 next = (u32)old_chunks & 0xFFFF;
+		u32 end = (u32)old_chunks >> 16;
+		if (next >= end)
+			return false;
+
+		if (from_back)
+			*chunk = --end;
+		else
+			*chunk = next++;
+
+		if (SDL_AtomicCAS(&queue->chunks, old_chunks, (s32)((end << 16) | next)))
+			return true;
+	}
+}
+
+static void
+run_job_chunks(struct job_system *jobs, u32 worker_index)
+{
+	u32 chunk;
+	for (;;) {
+		b32 found = take_job_chunk(jobs->queues + worker_index, false, &chunk);
+		for (u32 i = 1; !found && i < jobs->worker_count; ++i)
+			found = take_job_chunk(jobs->queues + (worker_index + i) % jobs->worker_count, true, &chunk);
+		if (!found)
+			return;
+
+		u32 begin = chunk * jobs->chunk_size;
+		u32 end = min_u(begin + jobs->chunk_size, jobs->count);
+		jobs->function(jobs->data, worker_index, begin, end);
+	}
+}
+
+static s32
+job_worker_main(void *data)
+{
+	struct job_worker *worker = data;
+	struct job_system *jobs = worker->jobs;
+	for (;;) {
+		SDL_SemWait(jobs->start);
+		if (jobs->quit)
+			break;
+
+		run_job_chunks(jobs, worker->index);
+		SDL_SemPost(jobs->done);
+	}
+	return 0;
+}
+
+static void
+init_job_system(struct job_system *jobs, u32 worker_count)
+{
+	ZERO_STRUCT(*jobs);
+#if defined(__EMSCRIPTEN__)
+	worker_count = 1;
+#endif
+	if (worker_count < 1)
+		worker_count = 1;
+	if (worker_count > MAX_JOB_WORKER_COUNT)
+		worker_count = MAX_JOB_WORKER_COUNT;
+
+	jobs->worker_count = 1;
+	jobs->workers[0].jobs = jobs;
+	if (worker_count == 1)
+		return;
+
+	jobs->start = SDL_CreateSemaphore(0);
+	jobs->done = SDL_CreateSemaphore(0);
+	if (!jobs->start || !jobs->done)
+		return;
+
+	/* NOTE(omid): Fall back to fewer workers if a thread won't start. */
+	for (u32 i = 1; i < worker_count; ++i) {
+		struct job_worker *worker = jobs->workers + i;
+		worker->jobs = jobs;
+		worker->index = i;
+		worker->thread = SDL_CreateThread(job_worker_main, "job worker", worker);
+		if (!worker->thread)
+			break;
+		++jobs->worker_count;
+	}
+}
+
+static void
+shutdown_job_system(struct job_system *jobs)
+{
+	jobs->quit = true;
+	for (u32 i = 1; i < jobs->worker_count; ++i)
+		SDL_SemPost(jobs->start);
+	for (u32 i = 1; i < jobs->worker_count; ++i)
+		SDL_WaitThread(jobs->workers[i].thread, 0);
+
+	if (jobs->start)
+		SDL_DestroySemaphore(jobs->start);
+	if (jobs->done)
+		SDL_DestroySemaphore(jobs->done);
+	ZERO_STRUCT(*jobs);
+}
+
+static void
+parallel_for(struct job_system *jobs, u32 count, u32 chunk_size, job_range_function *function, void *data)
+{
+	if (!count)
+		return;
+
+	if (chunk_size < 1)
+		chunk_size = 1;
+	while ((count + chunk_size - 1) / chunk_size > MAX_JOB_CHUNK_COUNT)
+		chunk_size *= 2;
+
+	u32 chunk_count = (count + chunk_size - 1) / chunk_size;
+	if (jobs->worker_count <= 1 || chunk_count == 1) {
+		function(data, 0, 0, count);
+		return;
+	}
+
+	jobs->function = function;
+	jobs->data = data;
+	jobs->count = count;
+	jobs->chunk_size = chunk_size;
+
+	u32 worker_count = jobs->worker_count;
+	for (u32 i = 0; i < worker_count; ++i) {
+		u32 begin = (chunk_count * i) / worker_count;
+		u32 end = (chunk_count * (i + 1)) / worker_count;
+		SDL_AtomicSet(&jobs->queues[i].chunks, (s32)((end << 16) | begin));
+	}
+
+	for (u32 i = 1; i < worker_count; ++i)
+		SDL_SemPost(jobs->start);
+
+	run_job_chunks(jobs, 0);
+
+	for (u32 i = 1; i < worker_count; ++i)
+		SDL_SemWait(jobs->done);
+}
+
 
 
 static const struct v2 screen_center = { .x = WINDOW_WIDTH / 2, .y = WINDOW_HEIGHT / 2 };
 static struct game_state *global_game;
 
 
+
+static void
+begin_profile_block(struct profiler *profiler, enum profile_phase phase)
+{
+	profiler->phase_begin[phase] = SDL_GetPerformanceCounter();
+}
+
+static void
+end_profile_block(struct profiler *profiler, enum profile_phase phase)
+{
+	profiler->phase_ticks[phase] += SDL_GetPerformanceCounter() - profiler->phase_begin[phase];
+}
+
+static bool
+open_profile_csv(struct profiler *profiler, const char *filename)
+{
+	profiler->csv = fopen(filename, "w");
+	if (!profiler->csv)
+		return false;
+
+	fprintf(profiler->csv, "frame");
+	for (u32 i = 0; i < PROFILE_PHASE_COUNT; ++i)
+		fprintf(profiler->csv, ",%s", PROFILE_PHASE_NAMES[i]);
+	fprintf(profiler->csv, "\n");
+
+	return true;
+}
+
+static void
+end_profile_frame(struct profiler *profiler, u32 frame_index)
+{
+	f32 *row = profiler->history[profiler->history_index];
+	for (u32 i = 0; i < PROFILE_PHASE_COUNT; ++i) {
+		row[i] = (f32)((f64)profiler->phase_ticks[i] * profiler->ticks_to_ms);
+		profiler->phase_ticks[i] = 0;
+	}
+
+	if (profiler->csv) {
+		fprintf(profiler->csv, "%u", frame_index);
+		for (u32 i = 0; i < PROFILE_PHASE_COUNT; ++i)
+			fprintf(profiler->csv, ",%.4f", (f64)row[i]);
+		fprintf(profiler->csv, "\n");
+	}
+
+	profiler->history_index = (profiler->history_index + 1) % PROFILE_HISTORY_COUNT;
+}
+
+
 static inline bool
 find_intersection_between_lines_(f32 P0_X,
 				 f32 P0_Y,
@@ -741,21 +1384,116 @@ test_collision_against_box(const struct entity_part *Obstacle,
 
 
 
+#define MAX_RECT_BATCH_COUNT 4096
+
+/* NOTE(omid): Filled rects are collected here and submitted together.
+ * Rects are stored in output pixels, already multiplied by the render
+ * scale that was current when they were pushed, so scale changes don't
+ * have to break the batch. Anything else that draws must flush first to
+ * keep the draw order. */
+struct rect_batch {
+	f32 scale_x;
+	f32 scale_y;
+	u32 count;
+	SDL_FRect rects[MAX_RECT_BATCH_COUNT];
+	struct color colors[MAX_RECT_BATCH_COUNT];
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	SDL_Vertex vertices[MAX_RECT_BATCH_COUNT * 4];
+	s32 indices[MAX_RECT_BATCH_COUNT * 6];
+	bool indices_ready;
+#endif
+};
+
+static struct rect_batch rect_batch = { .scale_x = 1, .scale_y = 1 };
+
+static void
+flush_rect_batch(SDL_Renderer *renderer)
+{
+	struct rect_batch *batch = &rect_batch;
+	if (!batch->count)
+		return;
+
+	SDL_RenderSetScale(renderer, 1, 1);
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	if (!batch->indices_ready) {
+		for (s32 i = 0; i < MAX_RECT_BATCH_COUNT; ++i) {
+			s32 *index = batch->indices + i * 6;
+			index[0] = i * 4;
+			index[1] = i * 4 + 1;
+			index[2] = i * 4 + 2;
+			index[3] = i * 4;
+			index[4] = i * 4 + 2;
+			index[5] = i * 4 + 3;
+		}
+		batch->indices_ready = true;
+	}
+
+	for (u32 i = 0; i < batch->count; ++i) {
+		SDL_FRect r = batch->rects[i];
+		struct color c = batch->colors[i];
+		SDL_Color vertex_color = { c.r, c.g, c.b, c.a };
+
+		SDL_Vertex *v = batch->vertices + i * 4;
+		v[0] = (SDL_Vertex){ { r.x, r.y }, vertex_color, { 0, 0 } };
+		v[1] = (SDL_Vertex){ { r.x + r.w, r.y }, vertex_color, { 0, 0 } };
+		v[2] = (SDL_Vertex){ { r.x + r.w, r.y + r.h }, vertex_color, { 0, 0 } };
+		v[3] = (SDL_Vertex){ { r.x, r.y + r.h }, vertex_color, { 0, 0 } };
+	}
+
+	SDL_RenderGeometry(renderer, 0, batch->vertices, (s32)batch->count * 4, batch->indices, (s32)batch->count * 6);
+#else
+	/* NOTE(omid): No SDL_RenderGeometry before 2.0.18; submit each run of
+	 * same-colored rects with a single SDL_RenderFillRectsF instead. */
+	u32 run_start = 0;
+	for (u32 i = 1; i <= batch->count; ++i) {
+		struct color c = batch->colors[run_start];
+		if (i < batch->count &&
+		    batch->colors[i].r == c.r && batch->colors[i].g == c.g &&
+		    batch->colors[i].b == c.b && batch->colors[i].a == c.a)
+			continue;
+
+		SDL_SetRenderDrawColor(renderer, c.r, c.g, c.b, c.a);
+		SDL_RenderFillRectsF(renderer, batch->rects + run_start, (s32)(i - run_start));
+		run_start = i;
+	}
+#endif
+
+	SDL_RenderSetScale(renderer, batch->scale_x, batch->scale_y);
+	batch->count = 0;
+}
+
+static void
+set_render_scale(SDL_Renderer *renderer, f32 scale_x, f32 scale_y)
+{
+	rect_batch.scale_x = scale_x;
+	rect_batch.scale_y = scale_y;
+	SDL_RenderSetScale(renderer, scale_x, scale_y);
+}
+
 static void
 fill_rect(SDL_Renderer *renderer, s32 x, s32 y, s32 width, s32 height, struct color color)
 {
-	SDL_Rect rect = {0};
-	rect.x = x;
-	rect.y = y;
-	rect.w = width;
-	rect.h = height;
-	SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
-	SDL_RenderFillRect(renderer, &rect);
+	struct rect_batch *batch = &rect_batch;
+	if (!width || !height)
+		return;
+
+	if (batch->count == MAX_RECT_BATCH_COUNT)
+		flush_rect_batch(renderer);
+
+	SDL_FRect *rect = batch->rects + batch->count;
+	rect->x = (f32)x * batch->scale_x;
+	rect->y = (f32)y * batch->scale_y;
+	rect->w = (f32)width * batch->scale_x;
+	rect->h = (f32)height * batch->scale_y;
+	batch->colors[batch->count++] = color;
 }
 
 static void
 draw_rect(SDL_Renderer *renderer, s32 x, s32 y, s32 width, s32 height, struct color color)
 {
+	flush_rect_batch(renderer);
+
 	SDL_Rect rect = {0};
 	rect.x = x;
 	rect.y = y;
@@ -771,45 +1509,269 @@ fill_rotated_rect(struct game_state *game, SDL_Renderer *renderer, s32 x, s32 y,
 	SDL_Rect source = { .w = width, .h = height };
 	SDL_Rect dest = { .x = x, .y = y, .w = width, .h = height };
 	SDL_Point center = { .x = source.w / 2, .y = source.h / 2 };
+	flush_rect_batch(renderer);
 	SDL_SetTextureColorMod(game->temp_texture, color.r, color.g, color.b);
 	SDL_SetTextureAlphaMod(game->temp_texture, color.a);
 	SDL_SetTextureBlendMode(game->temp_texture, SDL_BLENDMODE_BLEND);
 	SDL_RenderCopyEx(renderer, game->temp_texture, &source, &dest, angle * 180 / 3.14, &center, SDL_FLIP_NONE);
 }
 
-static void
-draw_string(SDL_Renderer *renderer,
-            TTF_Font *font,
-            const char *text,
-            s32 x, s32 y,
-            enum text_align alignment,
-            struct color color)
-{
-	SDL_Color sdl_color =  { color.r, color.g, color.b, color.a };
-	SDL_Surface *surface = TTF_RenderText_Solid(font, text, sdl_color);
-	SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-	SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
-	SDL_FreeSurface(surface);
+#define GLYPH_ATLAS_FIRST_CHAR 32
+#define GLYPH_ATLAS_CHAR_COUNT 95
+#define MAX_GLYPH_ATLAS_COUNT 4
+#define MAX_GLYPH_QUAD_COUNT 256
+
+struct glyph {
+	s16 x;
+	s16 w;
+	s16 advance;
+	s16 pad_;
+};
+
+/* NOTE(omid): Printable ASCII rendered once, white, into one texture;
+ * strings are tinted with the texture color and alpha mods. */
+struct glyph_atlas {
+	TTF_Font *font;
+	SDL_Texture *texture;
+	s32 width;
+	s32 height;
+	struct glyph glyphs[GLYPH_ATLAS_CHAR_COUNT];
+};
+
+static struct glyph_atlas glyph_atlases[MAX_GLYPH_ATLAS_COUNT];
+static u32 glyph_atlas_count;
+
+static bool
+build_glyph_atlas(SDL_Renderer *renderer, TTF_Font *font)
+{
+	if (!font || glyph_atlas_count >= MAX_GLYPH_ATLAS_COUNT)
+		return false;
+
+	struct glyph_atlas *atlas = glyph_atlases + glyph_atlas_count;
+	ZERO_STRUCT(*atlas);
+
+	SDL_Color white = { 0xFF, 0xFF, 0xFF, 0xFF };
+	SDL_Surface *glyph_surfaces[GLYPH_ATLAS_CHAR_COUNT];
+
+	s32 width = 0;
+	s32 height = TTF_FontHeight(font);
+	for (u32 i = 0; i < GLYPH_ATLAS_CHAR_COUNT; ++i) {
+		char text[2] = { (char)(GLYPH_ATLAS_FIRST_CHAR + i), 0 };
+		s32 advance = 0;
+		TTF_GlyphMetrics(font, (Uint16)text[0], 0, 0, 0, 0, &advance);
+
+		/* NOTE(omid): Render through the same path draw_string used so the
+		 * glyphs look identical; a space renders to nothing. */
+		SDL_Surface *surface = text[0] == ' ' ? 0 : TTF_RenderText_Solid(font, text, white);
+		glyph_surfaces[i] = surface;
+
+		struct glyph *glyph = atlas->glyphs + i;
+		glyph->x = (s16)width;
+		glyph->w = (s16)(surface ? surface->w : 0);
+		glyph->advance = (s16)advance;
+
+		width += glyph->w + 1;
+		if (surface && surface->h > height)
+			height = surface->h;
+	}
+
+	SDL_Surface *atlas_surface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_RGBA32);
+	if (atlas_surface) {
+		for (u32 i = 0; i < GLYPH_ATLAS_CHAR_COUNT; ++i) {
+			if (glyph_surfaces[i]) {
+				SDL_Rect dest = { .x = atlas->glyphs[i].x, .y = 0, .w = glyph_surfaces[i]->w, .h = glyph_surfaces[i]->h };
+				SDL_BlitSurface(glyph_surfaces[i], 0, atlas_surface, &dest);
+			}
+		}
+
+		atlas->texture = SDL_CreateTextureFromSurface(renderer, atlas_surface);
+		SDL_FreeSurface(atlas_surface);
+	}
+
+	for (u32 i = 0; i < GLYPH_ATLAS_CHAR_COUNT; ++i) {
+		if (glyph_surfaces[i])
+			SDL_FreeSurface(glyph_surfaces[i]);
+	}
+
+	if (!atlas->texture)
+		return false;
+
+	SDL_SetTextureBlendMode(atlas->texture, SDL_BLENDMODE_BLEND);
+	atlas->font = font;
+	atlas->width = width;
+	atlas->height = height;
+	++glyph_atlas_count;
+	return true;
+}
+
+static void
+destroy_glyph_atlases(void)
+{
+	for (u32 i = 0; i < glyph_atlas_count; ++i)
+		SDL_DestroyTexture(glyph_atlases[i].texture);
+	glyph_atlas_count = 0;
+}
+
+static const struct glyph_atlas *
+find_glyph_atlas(const TTF_Font *font)
+{
+	for (u32 i = 0; i < glyph_atlas_count; ++i) {
+		if (glyph_atlases[i].font == font)
+			return glyph_atlases + i;
+	}
+	return 0;
+}
+
+static const struct glyph *
+find_glyph(const struct glyph_atlas *atlas, char c)
+{
+	u32 index = (u32)(u8)c - GLYPH_ATLAS_FIRST_CHAR;
+	if (index >= GLYPH_ATLAS_CHAR_COUNT)
+		return 0;
+	return atlas->glyphs + index;
+}
+
+static s32
+measure_glyph_string(const struct glyph_atlas *atlas, const char *text)
+{
+	s32 width = 0;
+	for (const char *c = text; *c; ++c) {
+		const struct glyph *glyph = find_glyph(atlas, *c);
+		if (glyph)
+			width += glyph->advance;
+	}
+	return width;
+}
+
+static void
+draw_glyph_string(SDL_Renderer *renderer, const struct glyph_atlas *atlas, const char *text, s32 x, s32 y, struct color color)
+{
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	/* NOTE(omid): One geometry call per string, in chunks of
+	 * MAX_GLYPH_QUAD_COUNT glyphs. SDL_RenderGeometry ignores the texture
+	 * color and alpha mods, the color goes on the vertices. */
+	SDL_Vertex vertices[MAX_GLYPH_QUAD_COUNT * 4];
+	s32 indices[MAX_GLYPH_QUAD_COUNT * 6];
+	SDL_Color vertex_color = { color.r, color.g, color.b, color.a };
+	f32 inv_w = 1.0f / (f32)atlas->width;
+	u32 quad_count = 0;
+
+	for (const char *c = text;; ++c) {
+		if (!*c || quad_count == MAX_GLYPH_QUAD_COUNT) {
+			if (quad_count)
+				SDL_RenderGeometry(renderer, atlas->texture, vertices, (s32)quad_count * 4, indices, (s32)quad_count * 6);
+			quad_count = 0;
+			if (!*c)
+				break;
+		}
+
+		const struct glyph *glyph = find_glyph(atlas, *c);
+		if (!glyph)
+			continue;
+
+		if (glyph->w) {
+			f32 x0 = (f32)x, x1 = (f32)(x + glyph->w);
+			f32 y0 = (f32)y, y1 = (f32)(y + atlas->height);
+			f32 u0 = (f32)glyph->x * inv_w, u1 = (f32)(glyph->x + glyph->w) * inv_w;
+
+			SDL_Vertex *v = vertices + quad_count * 4;
+			v[0] = (SDL_Vertex){ { x0, y0 }, vertex_color, { u0, 0 } };
+			v[1] = (SDL_Vertex){ { x1, y0 }, vertex_color, { u1, 0 } };
+			v[2] = (SDL_Vertex){ { x1, y1 }, vertex_color, { u1, 1 } };
+			v[3] = (SDL_Vertex){ { x0, y1 }, vertex_color, { u0, 1 } };
+
+			s32 *index = indices + quad_count * 6;
+			s32 base = (s32)quad_count * 4;
+			index[0] = base;
+			index[1] = base + 1;
+			index[2] = base + 2;
+			index[3] = base;
+			index[4] = base + 2;
+			index[5] = base + 3;
+			++quad_count;
+		}
+
+		x += glyph->advance;
+	}
+#else
+	/* NOTE(omid): No SDL_RenderGeometry before 2.0.18; copies from a single
+	 * texture still end up in one batch in SDL's render queue. */
+	SDL_SetTextureColorMod(atlas->texture, color.r, color.g, color.b);
+	SDL_SetTextureAlphaMod(atlas->texture, color.a);
+
+	for (const char *c = text; *c; ++c) {
+		const struct glyph *glyph = find_glyph(atlas, *c);
+		if (!glyph)
+			continue;
+
+		if (glyph->w) {
+			SDL_Rect source = { .x = glyph->x, .y = 0, .w = glyph->w, .h = atlas->height };
+			SDL_Rect dest = { .x = x, .y = y, .w = glyph->w, .h = atlas->height };
+			SDL_RenderCopy(renderer, atlas->texture, &source, &dest);
+		}
+
+		x += glyph->advance;
+	}
+#endif
+}
+
+static void
+draw_string(SDL_Renderer *renderer,
+            TTF_Font *font,
+            const char *text,
+            s32 x, s32 y,
+            enum text_align alignment,
+            struct color color)
+{
+	flush_rect_batch(renderer);
+
+	const struct glyph_atlas *atlas = find_glyph_atlas(font);
+	if (atlas) {
+		s32 w = measure_glyph_string(atlas, text);
+		switch (alignment) {
+		case TEXT_ALIGN_LEFT:
+			break;
+		case TEXT_ALIGN_CENTER:
+			x -= w / 2;
+			break;
+		case TEXT_ALIGN_RIGHT:
+			x -= w;
+			break;
+		}
+
+		draw_glyph_string(renderer, atlas, text, x, y, color);
+#if defined(__EMSCRIPTEN__)
+		SDL_RenderDrawPoint(renderer, 0, 0);
+#endif
+		return;
+	}
+
+	SDL_Color sdl_color =  { color.r, color.g, color.b, color.a };
+	SDL_Surface *surface = TTF_RenderText_Solid(font, text, sdl_color);
+	if (!surface)
+		return;
+
+	SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
+	SDL_SetTextureBlendMode(texture, SDL_BLENDMODE_BLEND);
+
+	SDL_Rect rect;
+	rect.y = y;
+	rect.w = surface->w;
+	rect.h = surface->h;
+	SDL_FreeSurface(surface);
 
-	SDL_Rect rect;
-	rect.y = y;
-	rect.w = surface->w;
-	rect.h = surface->h;
 	switch (alignment) {
 	case TEXT_ALIGN_LEFT:
 		rect.x = x;
 		break;
 	case TEXT_ALIGN_CENTER:
-		rect.x = x - surface->w / 2;
+		rect.x = x - rect.w / 2;
 		break;
 	case TEXT_ALIGN_RIGHT:
-		rect.x = x - surface->w;
+		rect.x = x - rect.w;
 		break;
 	}
 
-	if (false)
-		printf("[%d, %d] -> [%d, %d, %d, %d]\n", surface->w, surface->h, rect.x, rect.y, rect.w, rect.h);
-
 	SDL_RenderCopy(renderer, texture, 0, &rect);
 #if defined(__EMSCRIPTEN__)
 	SDL_RenderDrawPoint(renderer, 0, 0);
@@ -850,6 +1812,34 @@ fill_cell_c(SDL_Renderer *renderer, s32 offset_x, s32 offset_y, s32 w, s32 h, st
 
 
 
+static void
+fill_cell_x_edges(SDL_Renderer *renderer, s32 x, s32 y, s32 w, s32 h, s32 offset_x, struct color light_color, struct color dark_color)
+{
+	s32 edge = (s32)((f32)w * fabsf((f32)offset_x - WINDOW_WIDTH / 2) / WINDOW_WIDTH);
+
+	if (offset_x > (WINDOW_WIDTH / 2)) {
+		fill_rect(renderer, x, y, edge, h, light_color);
+		fill_rect(renderer, x + w - edge, y, edge, h, dark_color);
+	} else {
+		fill_rect(renderer, x, y, edge, h, dark_color);
+		fill_rect(renderer, x + w - edge, y, edge, h, light_color);
+	}
+}
+
+static void
+fill_cell_y_edges(SDL_Renderer *renderer, s32 x, s32 y, s32 w, s32 h, s32 offset_y, struct color light_color, struct color dark_color)
+{
+	s32 edge = (s32)((f32)h * fabsf((f32)offset_y - WINDOW_HEIGHT / 2) / WINDOW_HEIGHT);
+
+	if (offset_y > (WINDOW_HEIGHT / 2)) {
+		fill_rect(renderer, x, y, w, edge, light_color);
+		fill_rect(renderer, x, y + h - edge, w, edge, dark_color);
+	} else {
+		fill_rect(renderer, x, y, w, edge, dark_color);
+		fill_rect(renderer, x, y + h - edge, w, edge, light_color);
+	}
+}
+
 static void
 render_cell_(SDL_Renderer *renderer,
 	     u8 value, u8 alpha, s32 offset_x, s32 offset_y, s32 w, s32 h,
@@ -863,8 +1853,6 @@ render_cell_(SDL_Renderer *renderer,
 	light_color.a = alpha;
 	dark_color.a = alpha;
 
-	s32 edge = 4; // GRID_SIZE / 8;
-
 	s32 x = (s32)(round(offset_x - (w / 2.0)));
 	s32 y = (s32)(round(offset_y - (h / 2.0)));
 
@@ -874,29 +1862,12 @@ render_cell_(SDL_Renderer *renderer,
 	}
 
 	fill_rect(renderer, x, y, w, h, base_color);
-
-	edge = (s32)((f32)w * fabsf((f32)offset_x - WINDOW_WIDTH / 2) / WINDOW_WIDTH);
-
-	if (offset_x > (WINDOW_WIDTH / 2)) {
-		fill_rect(renderer, x, y, edge, h, light_color);
-		fill_rect(renderer, x + w - edge, y, edge, h, dark_color);
-	} else {
-		fill_rect(renderer, x, y, edge, h, dark_color);
-		fill_rect(renderer, x + w - edge, y, edge, h, light_color);
-	}
-
-	edge = (s32)((f32)h * fabsf((f32)offset_y - WINDOW_HEIGHT / 2) / WINDOW_HEIGHT);
-
-	if (offset_y > (WINDOW_HEIGHT / 2)) {
-		fill_rect(renderer, x, y, w, edge, light_color);
-		fill_rect(renderer, x, y + h - edge, w, edge, dark_color);
-	} else {
-		fill_rect(renderer, x, y, w, edge, dark_color);
-		fill_rect(renderer, x, y + h - edge, w, edge, light_color);
-	}
+	fill_cell_x_edges(renderer, x, y, w, h, offset_x, light_color, dark_color);
+	fill_cell_y_edges(renderer, x, y, w, h, offset_y, light_color, dark_color);
 
 
 #if 0
+	s32 edge = 4; // GRID_SIZE / 8;
 	fill_rect(renderer, x, y, w, h, dark_color);
 	fill_rect(renderer, x + edge, y,
 		  w - edge, h - edge, light_color);
@@ -966,6 +1937,33 @@ special_fill_cell_(SDL_Renderer *renderer,
 }
 
 
+static void
+init_sine_table(f32 *table)
+{
+	for (u32 i = 0; i <= SINE_TABLE_SIZE; ++i)
+		table[i] = (f32)sin(2.0 * 3.14159265358979 * i / SINE_TABLE_SIZE);
+}
+
+static f32
+sample_sine_table(const f32 *table, u32 phase)
+{
+	u32 index = phase >> (32 - SINE_TABLE_BITS);
+	f32 frac = (f32)(phase & ((1u << (32 - SINE_TABLE_BITS)) - 1)) * (1.0f / (f32)(1u << (32 - SINE_TABLE_BITS)));
+	return table[index] + (table[index + 1] - table[index]) * frac;
+}
+
+static void
+start_sound_phase(struct sound *s, u64 sample_index)
+{
+	/* NOTE(omid): Phase is a 32-bit fraction of a cycle. Starting voices
+	 * at the phase of the global sample clock keeps sounds that are
+	 * re-pushed every frame continuous; the start phase is computed
+	 * exactly in integers so pitch doesn't drift with uptime. */
+	u64 cycle_fraction = ((u64)s->wave.freq * (sample_index % AUDIO_FREQ)) % AUDIO_FREQ;
+	s->phase = (u32)((cycle_fraction << 32) / AUDIO_FREQ);
+	s->phase_step = (u32)(((u64)s->wave.freq << 32) / AUDIO_FREQ);
+}
+
 static struct sound *
 push_sound(struct game_state *game, enum waveform_type type, u16 freq, f32 amp)
 {
@@ -978,6 +1976,8 @@ push_sound(struct game_state *game, enum waveform_type type, u16 freq, f32 amp)
 	s->type = type;
 	s->wave.freq = freq;
 	s->wave.amp = amp;
+	s->random = random_series_from_seed(next_random_u32(&game->audio_random));
+	start_sound_phase(s, game->played_audio_sample_count);
 
 	return s;
 }
@@ -996,6 +1996,8 @@ push_tagged_sound(struct game_state *game, enum waveform_type type, u16 freq, f3
 	s->wave.freq = freq;
 	s->wave.amp = amp;
 	s->wave.tag = child_tag;
+	s->random = random_series_from_seed(next_random_u32(&game->audio_random));
+	start_sound_phase(s, game->played_audio_sample_count);
 
 	return s;
 }
@@ -1006,12 +2008,57 @@ find_sound_by_tag(struct game_state *game, u16 top_tag, u16 child_tag)
 {
 	for (u32 i = 0; i < game->sound_count; ++i) {
 		struct sound *s = game->sounds + i;
-		if (s->tag == top_tag && s->wave.tag == child_tag)
+		if (s->tag == top_tag && s->wave.tag == child_tag && !s->disposed)
 			return s;
 	}
 	return 0;
 }
 
+static bool
+queue_sound_command(struct sound_command_queue *queue, struct sound_command command)
+{
+	u32 write = (u32)SDL_AtomicGet(&queue->write);
+	u32 read = (u32)SDL_AtomicGet(&queue->read);
+	if (write - read >= SOUND_COMMAND_QUEUE_SIZE) {
+		++queue->dropped_count;
+		return false;
+	}
+
+	queue->commands[write & (SOUND_COMMAND_QUEUE_SIZE - 1)] = command;
+	/* NOTE(omid): SDL_AtomicSet is a full barrier, the command is visible
+	 * before the new write index is. */
+	SDL_AtomicSet(&queue->write, (int)(write + 1));
+	return true;
+}
+
+static void
+queue_sound(struct game_state *game, enum waveform_type type, u16 freq, f32 amp)
+{
+	struct sound_command command = { .type = SOUND_COMMAND_START, .waveform = type, .freq = freq, .amp = amp, .once = true };
+	queue_sound_command(&game->sound_commands, command);
+}
+
+static void
+apply_sound_commands(struct game_state *game)
+{
+	struct sound_command_queue *queue = &game->sound_commands;
+	u32 read = (u32)SDL_AtomicGet(&queue->read);
+	u32 write = (u32)SDL_AtomicGet(&queue->write);
+
+	for (; read != write; ++read) {
+		struct sound_command command = queue->commands[read & (SOUND_COMMAND_QUEUE_SIZE - 1)];
+		switch (command.type) {
+		case SOUND_COMMAND_START: {
+			struct sound *s = push_sound(game, command.waveform, command.freq, command.amp);
+			if (s)
+				s->once = command.once;
+		} break;
+		}
+	}
+
+	SDL_AtomicSet(&queue->read, (int)read);
+}
+
 
 static struct game_event *
 push_game_event(struct game_state *game)
@@ -1062,101 +2109,450 @@ try_worm_eat_food(struct game_state *game, struct entity *e1, struct entity_part
 #endif
 
 
-static struct particle *
+static u32
 push_particle(struct game_state *game, enum particle_type type)
 {
-	if (game->particle_count >= MAX_PARTICLE_COUNT)
-		return 0;
+	struct particle_store *particles = &game->particles;
+	if (particles->count >= MAX_PARTICLE_COUNT) {
+		++game->commands.dropped_spawn_count;
+		return PARTICLE_INDEX_NONE;
+	}
 
-	struct particle *p = game->particles + (game->particle_count++);
-	ZERO_STRUCT(*p);
-	p->type = type;
-	p->spawn_t = game->time;
-	p->expiration_t = p->spawn_t + 5;
-	return p;
+	u32 index = particles->count++;
+	particles->p_x[index] = 0;
+	particles->p_y[index] = 0;
+	particles->v_x[index] = 0;
+	particles->v_y[index] = 0;
+	particles->a_x[index] = 0;
+	particles->a_y[index] = 0;
+	particles->expiration_t[index] = game->time + 5;
+	particles->flags[index] = 0;
+	particles->type[index] = (u16)type;
+	particles->width[index] = 0;
+	particles->height[index] = 0;
+
+	struct particle *info = particles->info + index;
+	ZERO_STRUCT(*info);
+	info->spawn_t = game->time;
+	return index;
 }
 
-static struct entity *
-push_entity(struct game_state *game)
+static void
+remove_particle(struct particle_store *particles, u32 index)
 {
-	u32 index = game->entity_count++;
-	struct entity *result = game->entities + index;
-	ZERO_STRUCT(*result);
-	result->id = ++game->entity_id_seq;
-	result->index = index;
-	result->seed = (u32)(rand());
-	result->spawn_t = game->time;
+	u32 last = --particles->count;
+	particles->p_x[index] = particles->p_x[last];
+	particles->p_y[index] = particles->p_y[last];
+	particles->v_x[index] = particles->v_x[last];
+	particles->v_y[index] = particles->v_y[last];
+	particles->a_x[index] = particles->a_x[last];
+	particles->a_y[index] = particles->a_y[last];
+	particles->expiration_t[index] = particles->expiration_t[last];
+	particles->flags[index] = particles->flags[last];
+	particles->type[index] = particles->type[last];
+	particles->width[index] = particles->width[last];
+	particles->height[index] = particles->height[last];
+	particles->info[index] = particles->info[last];
+}
 
-	game->entity_index_by_z[index] = index;
-	return result;
+static void
+load_particle_part(const struct particle_store *particles, u32 index, struct entity_part *part)
+{
+	/* NOTE(omid): The collision code works on entity parts; particles
+	 * are presented as one for the duration of the check. */
+	const struct particle *info = particles->info + index;
+	u32 flags = particles->flags[index];
+
+	ZERO_STRUCT(*part);
+	part->length = 1;
+	part->width = particles->width[index];
+	part->height = particles->height[index];
+	part->color = info->color;
+	part->disposed = (flags & PARTICLE_FLAG_DISPOSED) != 0;
+	part->die_at_screen_edge = (flags & PARTICLE_FLAG_DIE_AT_SCREEN_EDGE) != 0;
+	part->immune_to_wall = (flags & PARTICLE_FLAG_IMMUNE_TO_WALL) != 0;
+	part->passthrough = (flags & PARTICLE_FLAG_PASSTHROUGH) != 0;
+	part->mass = info->mass;
+	part->dmg = info->dmg;
+	part->angle = info->angle;
+	part->p = v2(particles->p_x[index], particles->p_y[index]);
+	part->v = v2(particles->v_x[index], particles->v_y[index]);
+	part->a = v2(particles->a_x[index], particles->a_y[index]);
 }
 
-static struct entity_part *
-push_entity_part_(struct entity *entity, u16 parent_index)
+static struct fx_particle *
+push_fx_particle(struct game_state *game)
 {
-	assert(entity->part_count < ARRAY_COUNT(entity->parts));
-	u16 index = entity->part_count++;
-	struct entity_part *result = entity->parts + index;
-	ZERO_STRUCT(*result);
-	result->index = index;
-	result->p = v2(WINDOW_WIDTH / 2, 0);
-	result->parent_index = parent_index;
+	if (game->fx_particle_count >= MAX_FX_PARTICLE_COUNT) {
+		++game->commands.dropped_spawn_count;
+		return 0;
+	}
 
-	if (parent_index != index)
-		result->depth = entity->parts[parent_index].depth + 1;
+	struct fx_particle *fx = game->fx_particles + game->fx_particle_count++;
+	ZERO_STRUCT(*fx);
+	fx->ttl = FX_PARTICLE_TTL;
+	return fx;
+}
 
-	return result;
+static void
+push_spawn_command(struct game_state *game, enum spawn_command_type type, struct entity_part_owner owner, struct v2 p, u8 color, u16 count)
+{
+	struct sim_commands *commands = &game->commands;
+	if (commands->spawn_count >= MAX_SPAWN_COMMAND_COUNT) {
+		++commands->dropped_command_count;
+		return;
+	}
+
+	struct spawn_command *command = commands->spawns + commands->spawn_count++;
+	command->type = (u8)type;
+	command->color = color;
+	command->count = count;
+	command->owner = owner;
+	command->p = p;
 }
 
-static struct entity_part *
-push_entity_part(struct entity *entity, u16 length, u16 size, u16 color, u16 parent_index)
+static void
+push_damage_command(struct game_state *game, struct entity_part_owner owner, u32 target_index, u32 target_part_index, u16 dmg, u16 particle_type)
 {
-	struct entity_part *p = push_entity_part_(entity, parent_index);
-	p->length = length;
-	p->width = size;
-	p->height = size;
-	p->mass = p->width * p->height;
-	p->color = color;
-	p->immune_to_wall = true;
-	p->max_hp = p->hp = 5;
-	return p;
+	struct sim_commands *commands = &game->commands;
+	if (commands->damage_count >= MAX_DAMAGE_COMMAND_COUNT) {
+		++commands->dropped_command_count;
+		return;
+	}
+
+	struct damage_command *command = commands->damages + commands->damage_count++;
+	command->owner = owner;
+	command->target_index = (u16)target_index;
+	command->target_part_index = (u16)target_part_index;
+	command->dmg = dmg;
+	command->particle_type = particle_type;
+}
+
+static void
+link_part_block(struct entity_part_pool *pool, u16 start, u32 order)
+{
+	struct part_block_link *link = pool->links + start;
+	link->prev = PART_BLOCK_NONE;
+	link->next = pool->free_blocks[order];
+	link->free_order = (u8)(order + 1);
+	if (link->next != PART_BLOCK_NONE)
+		pool->links[link->next].prev = start;
+	pool->free_blocks[order] = start;
 }
 
+static void
+unlink_part_block(struct entity_part_pool *pool, u16 start, u32 order)
+{
+	struct part_block_link *link = pool->links + start;
+	if (link->prev != PART_BLOCK_NONE)
+		pool->links[link->prev].next = link->next;
+	else
+		pool->free_blocks[order] = link->next;
+	if (link->next != PART_BLOCK_NONE)
+		pool->links[link->next].prev = link->prev;
+	link->free_order = 0;
+}
 
 static void
-add_squid_leg(struct entity *entity, u16 parent_index, u16 color, u16 length, u16 spacing, u16 size, f32 stiffness, u16 hp)
+init_entity_part_pool(struct entity_part_pool *pool)
 {
-	struct entity_part *p;
+	for (u32 order = 0; order < PART_BLOCK_ORDER_COUNT; ++order)
+		pool->free_blocks[order] = PART_BLOCK_NONE;
 
-	for (u16 i = 0; i < length; ++i) {
-		p = push_entity_part(entity, spacing, size - i, color, parent_index);
-		p->stiffness = stiffness;
-		p->max_hp = p->hp = hp;
-		parent_index = p->index;
+	for (u32 start = MAX_POOLED_PART_COUNT; start;) {
+		start -= MAX_PART_BLOCK_SIZE;
+		link_part_block(pool, (u16)start, PART_BLOCK_ORDER_COUNT - 1);
 	}
 
-	/* p = add_part(entity); */
-	/* p->length = 25; */
-	/* p->size = 25; */
-	/* p->color = 2; */
-	/* p->p = v2(-40, 20); */
-	/* p->parent_index = parent_index; */
+	pool->allocated_part_count = 0;
+}
 
-	/* parent_index = p->index; */
+static u16
+allocate_part_block(struct entity_part_pool *pool, u32 order)
+{
+	u32 found_order = order;
+	while (found_order < PART_BLOCK_ORDER_COUNT && pool->free_blocks[found_order] == PART_BLOCK_NONE)
+		++found_order;
 
-	/* p = add_part(entity); */
-	/* p->length = 25; */
-	/* p->size = 20; */
-	/* p->color = 4; */
-	/* p->parent_index = parent_index; */
+	if (found_order == PART_BLOCK_ORDER_COUNT)
+		return PART_BLOCK_NONE;
 
-	/* parent_index = p->index; */
+	u16 start = pool->free_blocks[found_order];
+	unlink_part_block(pool, start, found_order);
 
-	/* p = add_part(entity); */
-	/* p->length = 25; */
-	/* p->size = 20; */
-	/* p->color = 5; */
-	/* p->parent_index = parent_index; */
+	/* NOTE(omid): Split down to the requested size, returning the upper
+	 * halves to the free lists. */
+	while (found_order > order) {
+		--found_order;
+		link_part_block(pool, (u16)(start + (1u << found_order)), found_order);
+	}
+
+	pool->allocated_part_count += 1u << order;
+	return start;
+}
+
+static void
+free_part_block(struct entity_part_pool *pool, u16 start, u32 order)
+{
+	pool->allocated_part_count -= 1u << order;
+
+	while (order < PART_BLOCK_ORDER_COUNT - 1) {
+		u16 buddy = (u16)(start ^ (1u << order));
+		if (pool->links[buddy].free_order != order + 1)
+			break;
+
+		unlink_part_block(pool, buddy, order);
+		start = min_u(start, buddy);
+		++order;
+	}
+
+	link_part_block(pool, start, order);
+}
+
+static bool
+reserve_entity_parts(struct entity_part_pool *pool, struct entity *entity, u32 part_count)
+{
+	u32 capacity = entity->parts ? (1u << entity->part_block_order) : 0;
+	if (part_count <= capacity)
+		return true;
+
+	u32 order = 0;
+	while ((1u << order) < part_count)
+		++order;
+
+	u16 start = allocate_part_block(pool, order);
+	if (start == PART_BLOCK_NONE)
+		return false;
+
+	struct entity_part *parts = pool->parts + start;
+	if (entity->parts) {
+		memcpy(parts, entity->parts, sizeof(struct entity_part) * entity->part_count);
+		free_part_block(pool, (u16)(entity->parts - pool->parts), entity->part_block_order);
+	}
+
+	entity->parts = parts;
+	entity->part_block_order = order;
+	return true;
+}
+
+static void
+release_entity_parts(struct entity_part_pool *pool, struct entity *entity)
+{
+	if (entity->parts) {
+		free_part_block(pool, (u16)(entity->parts - pool->parts), entity->part_block_order);
+		entity->parts = 0;
+		entity->part_count = 0;
+	}
+}
+
+static bool
+same_entity(struct entity_handle a, struct entity_handle b)
+{
+	return a.slot == b.slot && a.generation == b.generation;
+}
+
+static struct entity_handle
+allocate_entity_slot(struct game_state *game, u32 entity_index)
+{
+	u16 slot_index;
+	if (game->free_entity_slot_count)
+		slot_index = game->free_entity_slots[--game->free_entity_slot_count];
+	else
+		slot_index = (u16)(game->entity_slot_high_water++);
+
+	/* NOTE(omid): Bump the generation on reuse so stale handles to the
+	 * previous occupant stop resolving. Generation 0 is never handed out,
+	 * so a zeroed handle is always invalid. */
+	struct entity_slot *slot = game->entity_slots + slot_index;
+	if (!++slot->generation)
+		slot->generation = 1;
+	slot->entity_index = (u16)entity_index;
+
+	struct entity_handle result = { .slot = slot_index, .generation = slot->generation };
+	return result;
+}
+
+static void
+release_entity_slot(struct game_state *game, struct entity_handle handle)
+{
+	struct entity_slot *slot = game->entity_slots + handle.slot;
+	slot->entity_index = UINT16_MAX;
+	game->free_entity_slots[game->free_entity_slot_count++] = handle.slot;
+}
+
+static struct entity *
+find_entity(struct game_state *game, struct entity_handle handle)
+{
+	if (!handle.generation || handle.slot >= game->entity_slot_high_water)
+		return 0;
+
+	const struct entity_slot *slot = game->entity_slots + handle.slot;
+	if (slot->generation != handle.generation || slot->entity_index >= game->entity_count)
+		return 0;
+
+	return game->entities + slot->entity_index;
+}
+
+static struct entity *
+find_player(struct game_state *game)
+{
+	return find_entity(game, game->player);
+}
+
+/* NOTE(omid): Moves the last entity into the hole and leaves
+ * entity_index_by_z alone, begin_game_frame fixes the z order once for
+ * all of the frame's removals with remap_entity_z_order. */
+static void
+remove_entity(struct game_state *game, u32 entity_index)
+{
+	release_entity_slot(game, game->entities[entity_index].handle);
+	release_entity_parts(&game->part_pool, game->entities + entity_index);
+
+	u32 last_index = --game->entity_count;
+	if (entity_index != last_index) {
+		game->entities[entity_index] = game->entities[last_index];
+		game->entities[entity_index].index = entity_index;
+		game->entity_slots[game->entities[entity_index].handle.slot].entity_index = (u16)entity_index;
+	}
+}
+
+/* NOTE(omid): origin[i] is the index entity i had when entity_index_by_z
+ * was last valid, for the old_count entities back then. Drops the removed
+ * entities and renames the moved ones in a single pass. */
+static void
+remap_entity_z_order(struct game_state *game, const u16 *origin, u32 old_count)
+{
+	u16 new_index[MAX_ENTITY_COUNT];
+	for (u32 i = 0; i < old_count; ++i)
+		new_index[i] = UINT16_MAX;
+	for (u32 i = 0; i < game->entity_count; ++i)
+		new_index[origin[i]] = (u16)i;
+
+	u32 order_count = 0;
+	for (u32 i = 0; i < old_count; ++i) {
+		u16 index = new_index[game->entity_index_by_z[i]];
+		if (index != UINT16_MAX)
+			game->entity_index_by_z[order_count++] = index;
+	}
+	assert(order_count == game->entity_count);
+}
+
+static void
+remove_all_entities(struct game_state *game)
+{
+	while (game->entity_count)
+		remove_entity(game, game->entity_count - 1);
+}
+
+static struct entity *
+push_entity(struct game_state *game)
+{
+	u32 index = game->entity_count++;
+	struct entity *result = game->entities + index;
+	ZERO_STRUCT(*result);
+	result->handle = allocate_entity_slot(game, index);
+	result->index = index;
+	result->seed = next_random_u32(&game->random);
+	result->random = random_series_from_seed(result->seed);
+	result->spawn_t = game->time;
+
+	game->entity_index_by_z[index] = index;
+	return result;
+}
+
+/* NOTE(omid): Takes back the entity push_entity just returned, before
+ * anything else is pushed or the z order is sorted. */
+static void
+pop_entity(struct game_state *game, struct entity *entity)
+{
+	assert(entity->index == game->entity_count - 1);
+	assert(game->entity_index_by_z[entity->index] == entity->index);
+	remove_entity(game, entity->index);
+}
+
+static struct entity_part *
+push_entity_part_(struct game_state *game, struct entity *entity, u16 parent_index)
+{
+	/* NOTE(omid): Both limits are hit in release builds too, callers have
+	 * to handle a null part. */
+	if (entity->part_count >= MAX_ENTITY_PART_COUNT)
+		return 0;
+	if (!reserve_entity_parts(&game->part_pool, entity, entity->part_count + 1u))
+		return 0;
+
+	u16 index = entity->part_count++;
+	struct entity_part *result = entity->parts + index;
+	ZERO_STRUCT(*result);
+	result->index = index;
+	result->p = v2(WINDOW_WIDTH / 2, 0);
+	result->parent_index = parent_index;
+	result->first_child = ENTITY_PART_NONE;
+	result->next_sibling = ENTITY_PART_NONE;
+
+	if (parent_index != index) {
+		struct entity_part *parent = entity->parts + parent_index;
+		result->depth = parent->depth + 1;
+		result->next_sibling = parent->first_child;
+		parent->first_child = index;
+	}
+
+	return result;
+}
+
+static struct entity_part *
+push_entity_part(struct game_state *game, struct entity *entity, u16 length, u16 size, u16 color, u16 parent_index)
+{
+	struct entity_part *p = push_entity_part_(game, entity, parent_index);
+	if (!p)
+		return 0;
+
+	p->length = length;
+	p->width = size;
+	p->height = size;
+	p->mass = p->width * p->height;
+	p->color = color;
+	p->immune_to_wall = true;
+	p->max_hp = p->hp = 5;
+	return p;
+}
+
+
+static void
+add_squid_leg(struct game_state *game, struct entity *entity, u16 parent_index, u16 color, u16 length, u16 spacing, u16 size, f32 stiffness, u16 hp)
+{
+	struct entity_part *p;
+
+	for (u16 i = 0; i < length; ++i) {
+		p = push_entity_part(game, entity, spacing, size - i, color, parent_index);
+		if (!p)
+			break;
+		p->stiffness = stiffness;
+		p->max_hp = p->hp = hp;
+		parent_index = p->index;
+	}
+
+	/* p = add_part(entity); */
+	/* p->length = 25; */
+	/* p->size = 25; */
+	/* p->color = 2; */
+	/* p->p = v2(-40, 20); */
+	/* p->parent_index = parent_index; */
+
+	/* parent_index = p->index; */
+
+	/* p = add_part(entity); */
+	/* p->length = 25; */
+	/* p->size = 20; */
+	/* p->color = 4; */
+	/* p->parent_index = parent_index; */
+
+	/* parent_index = p->index; */
+
+	/* p = add_part(entity); */
+	/* p->length = 25; */
+	/* p->size = 20; */
+	/* p->color = 5; */
+	/* p->parent_index = parent_index; */
 
 	/* parent_index = p->index; */
 
@@ -1168,63 +2564,65 @@ add_squid_leg(struct entity *entity, u16 parent_index, u16 color, u16 length, u1
 }
 
 static struct entity *
-init_lightning(struct entity *entity, u32 from_id, u16 from_part_index, u32 to_id, u16 to_part_index, f32 expiration_t)
+init_lightning(struct game_state *game, struct entity *entity, struct entity_handle from, u16 from_part_index, struct entity_handle to, u16 to_part_index, f32 expiration_t)
 {
 	entity->type = ENTITY_LIGHTNING;
 	entity->expiration_t = expiration_t;
-	entity->from_id = from_id;
-	entity->to_id = to_id;
+	entity->from = from;
+	entity->to = to;
 	entity->from_part_index = from_part_index;
 	entity->to_part_index = to_part_index;
 	entity->z = 1;
 	entity->expire = true;
 
-	struct entity_part *p;
-	p = push_entity_part(entity, 0, 0, UINT8_MAX, 0);
+	if (!push_entity_part(game, entity, 0, 0, UINT8_MAX, 0))
+		return 0;
 
 	return entity;
 }
 
 static void
-push_worm_tail(struct entity *entity)
+push_worm_tail(struct game_state *game, struct entity *entity)
 {
-	if (entity->part_count >= ARRAY_COUNT(entity->parts))
+	if (entity->part_count >= MAX_ENTITY_PART_COUNT)
 		return;
 
 	u16 parent_index = entity->part_count ? (entity->part_count - 1) : 0;
 
 	struct entity_part *p;
-	p = push_entity_part(entity, 25, (u16)(40 - entity->part_count), 2, parent_index);
+	p = push_entity_part(game, entity, 25, (u16)(40 - entity->part_count), 2, parent_index);
+	if (!p)
+		return;
 	p->p = entity->parts[p->index - 1].p;
 	p->immune_to_wall = true;
 	p->max_hp = p->hp = 5;
 }
 
 static struct entity *
-init_worm(struct entity *entity)
+init_worm(struct game_state *game, struct entity *entity)
 {
 	entity->type = 0;
 	entity->part_count = 0;
 
-	struct entity_part *p;
-	p = push_entity_part(entity, 0, 40, 2, 0);
+	if (!push_entity_part(game, entity, 0, 40, 2, 0))
+		return 0;
 
 	for (u32 i = 1; i < 4; ++i)
-		push_worm_tail(entity);
+		push_worm_tail(game, entity);
 
 	return entity;
 }
 
 
 static struct entity *
-init_enemy(struct entity *entity, u32 difficulty)
+init_enemy(struct game_state *game, struct entity *entity, u32 difficulty)
 {
 	entity->type = ENTITY_ENEMY;
 	entity->part_count = 0;
 
 	u8 c1, c2, c3;
 	c1 = 0; c2 = 0; c3 = 0;
-	u16 color_type = (u16)random_int(0, 4);
+	u16 color_type = (u16)random_int(&entity->random, 0, 4);
 	switch (color_type) {
 	case 0:
 		c1 = 7;
@@ -1248,9 +2646,9 @@ init_enemy(struct entity *entity, u32 difficulty)
 		break;
 	}
 
-	u16 head_size = (u16)(random_int(30, 100));
+	u16 head_size = (u16)(random_int(&entity->random, 30, 100));
 	u16 secondary_max_size = head_size / 2;
-	u16 secondary_count = (u16)random_int(0, 8);
+	u16 secondary_count = (u16)random_int(&entity->random, 0, 8);
 	if (secondary_max_size < 20)
 		secondary_count = 0;
 
@@ -1264,7 +2662,14 @@ init_enemy(struct entity *entity, u32 difficulty)
 	if (fire_rate > UINT8_MAX)
 		fire_rate = UINT8_MAX;
 
-	struct entity_part *head = push_entity_part(entity, 0, head_size, c1, 0);
+	/* NOTE(omid): Reserve every part up front, 'head' is used after the
+	 * secondaries are pushed and must not move. No room means no enemy. */
+	if (!reserve_entity_parts(&game->part_pool, entity, 1u + secondary_count))
+		return 0;
+
+	struct entity_part *head = push_entity_part(game, entity, 0, head_size, c1, 0);
+	if (!head)
+		return 0;
 	head->mass *= 100;
 	head->max_hp = head->hp = hp;
 	head->internal_collisions = true;
@@ -1272,18 +2677,18 @@ init_enemy(struct entity *entity, u32 difficulty)
 	head->fire_rate = (u8)fire_rate;
 	/* head->dmg = PARTICLE_FIREBALL; */
 
-	/* u16 secondary_count = (u16)random_int(0, 8); */
+	/* u16 secondary_count = (u16)random_int(&entity->random, 0, 8); */
 
 	/* secondary_count = 0; */
 
 	if (secondary_count) {
-		if (random_f32() > 0.8f) {
+		if (random_f32(&entity->random) > 0.8f) {
 			/* NOTE(omid): Snake. */
-			u16 secondary_size = (u16)(random_int(19, secondary_max_size));
+			u16 secondary_size = (u16)(random_int(&entity->random, 19, secondary_max_size));
 
 			f32 scale = (f32)secondary_size / (f32)head_size;
-			add_squid_leg(entity, head->index, c2, secondary_count, 30, secondary_size, 2, (u16)(scale * hp));
-			if (random_f32() > 0.5f) {
+			add_squid_leg(game, entity, head->index, c2, secondary_count, 30, secondary_size, 2, (u16)(scale * hp));
+			if (random_f32(&entity->random) > 0.5f) {
 				head->dmg |= PARTICLE_FIREBALL;
 				head->fire_rate = 3;
 			} else {
@@ -1292,10 +2697,12 @@ init_enemy(struct entity *entity, u32 difficulty)
 			}
 		} else {
 			for (u16 i = 0; i < secondary_count; ++i) {
-				u16 secondary_size = (u16)(random_int(19, secondary_max_size));
+				u16 secondary_size = (u16)(random_int(&entity->random, 19, secondary_max_size));
 				f32 scale = (f32)secondary_size / (f32)head_size;
 
-				struct entity_part *s = push_entity_part(entity, head_size, secondary_size, c2, head->index);
+				struct entity_part *s = push_entity_part(game, entity, head_size, secondary_size, c2, head->index);
+				if (!s)
+					break;
 				s->internal_collisions = true;
 				s->stiffness = 10;
 				s->max_hp = s->hp = (u16)(scale * hp);
@@ -1306,14 +2713,14 @@ init_enemy(struct entity *entity, u32 difficulty)
 	}
 
 	/* struct entity_part *p; */
-	/* p = push_entity_part(entity, 0, 25 + param, c1, 0); */
+	/* p = push_entity_part(game, entity, 0, 25 + param, c1, 0); */
 	/* p->mass = 50 * 50; */
 	/* p->hp = 10; */
 
 	/* struct entity_part *l1; */
 	/* struct entity_part *l2; */
-	/* l1 = push_entity_part(entity, 25, 20 + param, c2, 0); */
-	/* l2 = push_entity_part(entity, 25, 20 + param, c2, 0); */
+	/* l1 = push_entity_part(game, entity, 25, 20 + param, c2, 0); */
+	/* l2 = push_entity_part(game, entity, 25, 20 + param, c2, 0); */
 	/* l1->internal_collisions = l2->internal_collisions = true; */
 	/* l1->stiffness = 2; */
 	/* l2->stiffness = 2; */
@@ -1325,13 +2732,15 @@ init_enemy(struct entity *entity, u32 difficulty)
 }
 
 static struct entity *
-init_player(struct entity *entity)
+init_player(struct game_state *game, struct entity *entity)
 {
 	struct entity_part *p;
 
 	entity->type = ENTITY_PLAYER;
 
-	p = push_entity_part(entity, 0, 25, 1, 0);
+	p = push_entity_part(game, entity, 0, 25, 1, 0);
+	if (!p)
+		return 0;
 	p->p.y = WINDOW_HEIGHT;
 	p->mass = 100000;
 	p->immune_to_wall = false;
@@ -1341,8 +2750,8 @@ init_player(struct entity *entity)
 	p->fire_rate = 100;
 	p->name = "HULL";
 
-	if (true) {
-		struct entity_part *l1 = push_entity_part(entity, 40, 20, 0, 0);
+	struct entity_part *l1 = push_entity_part(game, entity, 40, 20, 0, 0);
+	if (l1) {
 		l1->internal_collisions = true;
 		l1->stiffness = 2;
 		/* l1->mass = 10; */
@@ -1353,7 +2762,7 @@ init_player(struct entity *entity)
 	}
 
 	/* if (true) { */
-	/* 	struct entity_part *l1 = push_entity_part(entity, 40, 20, 0, 0); */
+	/* 	struct entity_part *l1 = push_entity_part(game, entity, 40, 20, 0, 0); */
 	/* 	l1->internal_collisions = true; */
 	/* 	l1->stiffness = 2; */
 	/* 	l1->mass = 1; */
@@ -1364,7 +2773,7 @@ init_player(struct entity *entity)
 
 
 	/* if (true) { */
-	/* 	struct entity_part *l1 = push_entity_part(entity, 20, 20, 0, 0); */
+	/* 	struct entity_part *l1 = push_entity_part(game, entity, 20, 20, 0, 0); */
 	/* 	l1->internal_collisions = true; */
 	/* 	l1->stiffness = 2; */
 	/* 	l1->mass = 1; */
@@ -1372,7 +2781,7 @@ init_player(struct entity *entity)
 	/* } */
 
 	/* if (true) { */
-	/* 	struct entity_part *l1 = push_entity_part(entity, 50, 20, 5, 0); */
+	/* 	struct entity_part *l1 = push_entity_part(game, entity, 50, 20, 5, 0); */
 	/* 	l1->internal_collisions = true; */
 	/* 	l1->stiffness = 2; */
 	/* 	l1->mass = 1; */
@@ -1380,7 +2789,7 @@ init_player(struct entity *entity)
 	/* } */
 
 	/* { */
-	/* 	struct entity_part *l2 = push_entity_part(entity, 40, 20, 9, 0); */
+	/* 	struct entity_part *l2 = push_entity_part(game, entity, 40, 20, 9, 0); */
 	/* 	l2->internal_collisions = true; */
 	/* 	l2->stiffness = 2; */
 	/* 	l2->mass = 1; */
@@ -1388,7 +2797,7 @@ init_player(struct entity *entity)
 	/* } */
 
 	/* { */
-	/* 	struct entity_part *l2 = push_entity_part(entity, 40, 20, 9, 0); */
+	/* 	struct entity_part *l2 = push_entity_part(game, entity, 40, 20, 9, 0); */
 	/* 	l2->internal_collisions = true; */
 	/* 	l2->stiffness = 2; */
 	/* 	l2->mass = 1; */
@@ -1396,7 +2805,7 @@ init_player(struct entity *entity)
 	/* } */
 
 	/* { */
-	/* 	struct entity_part *l2 = push_entity_part(entity, 40, 20, 9, 0); */
+	/* 	struct entity_part *l2 = push_entity_part(game, entity, 40, 20, 9, 0); */
 	/* 	l2->internal_collisions = true; */
 	/* 	l2->stiffness = 2; */
 	/* 	l2->mass = 1; */
@@ -1408,23 +2817,6 @@ init_player(struct entity *entity)
 	return entity;
 }
 
-static bool
-find_entity_by_id(const struct game_state *game, u32 entity_id, u32 *index)
-{
-	u32 i = *index;
-	if (i < game->entity_count && game->entities[i].id == entity_id)
-		return true;
-
-	for (i = 0; i < game->entity_count; ++i) {
-		if (game->entities[i].id == entity_id) {
-			*index = i;
-			return true;
-		}
-	}
-
-	return false;
-}
-
 static u32
 count_entity_of_type(const struct game_state *game, enum entity_type type)
 {
@@ -1434,20 +2826,6 @@ count_entity_of_type(const struct game_state *game, enum entity_type type)
 	return result;
 }
 
-static u16
-compute_entity_part_depth(const struct entity *entity, const struct entity_part *part)
-{
-	u16 depth = 0;
-	const struct entity_part *p = part;
-	while (p->parent_index != p->index) {
-		depth++;
-
-		p = entity->parts + p->parent_index;
-	}
-
-	return depth;
-}
-
 static f32
 compute_entity_mass(const struct entity *entity)
 {
@@ -1475,59 +2853,105 @@ push_spawn_item(struct game_state *game, enum entity_type type, u32 param, u32 g
 }
 
 static void
-spawn_explosion(struct game_state *game, struct entity_part_owner owner, u8 color, struct v2 location, u32 size)
+spawn_explosion(struct game_state *game, struct random_series *series, struct entity_part_owner owner, u8 color, struct v2 location, u32 size)
 {
+	struct particle_store *particles = &game->particles;
 	u32 more_p = size;
 	while ((more_p--)) {
-		struct particle *particle = push_particle(game, PARTICLE_DEBRIS);
-		if (!particle)
-			break;
+		u32 index = push_particle(game, PARTICLE_DEBRIS);
+		if (index == PARTICLE_INDEX_NONE)
+			continue;
 
-		particle->expiration_t = game->time + 1;
-		struct entity_part *p = &particle->part;
-		particle->type = more_p == (size - 1) ? PARTICLE_EXPLOSION : PARTICLE_BULLET;
-		particle->owner_id = owner.entity_id;
-		particle->owner_index = (u16)owner.entity_index;
+		struct particle *particle = particles->info + index;
+		u16 type = more_p == (size - 1) ? PARTICLE_EXPLOSION : PARTICLE_BULLET;
+		u16 width = (u16)random_int(series, 4, 8);
+		particles->expiration_t[index] = game->time + 1;
+		particles->type[index] = type;
+		particle->owner = owner.entity;
 		particle->owner_part_index = owner.entity_part_index;
-		p->dmg = 1;
-		p->length = 1;
-		p->width = (u16)random_int(4, 8);
-		p->height = p->width;
-		p->mass = p->width * p->height;
-		p->color = color;
-		p->p = location;
-		p->a = v2((random_f32() - 0.5f) * 100 / p->width, (random_f32() - 0.5f) * 100 / p->height);
-		p->passthrough = true;
-		p->die_at_screen_edge = particle->type == PARTICLE_BULLET;
-		p->immune_to_wall = particle->type == PARTICLE_EXPLOSION;
+		particle->dmg = 1;
+		particles->width[index] = width;
+		particles->height[index] = width;
+		particle->mass = width * width;
+		particle->color = color;
+		particles->p_x[index] = location.x;
+		particles->p_y[index] = location.y;
+		struct v2 a = v2((random_f32(series) - 0.5f) * 100 / width, (random_f32(series) - 0.5f) * 100 / width);
+		particles->a_x[index] = a.x;
+		particles->a_y[index] = a.y;
+		particles->flags[index] = PARTICLE_FLAG_PASSTHROUGH |
+			(type == PARTICLE_BULLET ? PARTICLE_FLAG_DIE_AT_SCREEN_EDGE : 0) |
+			(type == PARTICLE_EXPLOSION ? PARTICLE_FLAG_IMMUNE_TO_WALL : 0);
 	}
 }
 
 static void
-spawn_debris(struct game_state *game, struct entity_part_owner owner, u16 color, struct v2 location, u32 count, bool bang)
+spawn_debris(struct game_state *game, struct random_series *series, struct entity_part_owner owner, u16 color, struct v2 location, u32 count, bool bang)
 {
+	struct particle_store *particles = &game->particles;
 	u32 more_p = count;
 	while ((more_p--)) {
-		struct particle *particle = push_particle(game, PARTICLE_DEBRIS);
-		if (!particle)
-			break;
+		if (bang && more_p == (count - 1)) {
+			/* NOTE(omid): The bang is a particle since update_audio
+			 * plays it, the rest of the debris is only drawn. */
+			u32 index = push_particle(game, PARTICLE_EXPLOSION);
+			if (index == PARTICLE_INDEX_NONE)
+				continue;
 
-		particle->expiration_t = game->time + 1;
-		struct entity_part *p = &particle->part;
-		particle->type = bang && more_p == (count - 1) ? PARTICLE_EXPLOSION : PARTICLE_DEBRIS;
-		particle->owner_id = owner.entity_id;
-		particle->owner_index = (u16)owner.entity_index;
-		particle->owner_part_index = owner.entity_part_index;
-		p->length = 1;
-		p->width = (u16)random_int(4, 8);
-		p->height = p->width;
-		p->mass = p->width * p->height;
-		p->color = color;
-		p->p = location;
-		p->a = v2((random_f32() - 0.5f) * 100 / p->width, (random_f32() - 0.5f) * 100 / p->height);
-		p->passthrough = true;
-		p->die_at_screen_edge = particle->type == PARTICLE_DEBRIS;
-		p->immune_to_wall = particle->type == PARTICLE_EXPLOSION;
+			struct particle *particle = particles->info + index;
+			u16 width = (u16)random_int(series, 4, 8);
+			particles->expiration_t[index] = game->time + 1;
+			particle->owner = owner.entity;
+			particle->owner_part_index = owner.entity_part_index;
+			particles->width[index] = width;
+			particles->height[index] = width;
+			particle->mass = width * width;
+			particle->color = color;
+			particles->p_x[index] = location.x;
+			particles->p_y[index] = location.y;
+			struct v2 a = v2((random_f32(series) - 0.5f) * 100 / width, (random_f32(series) - 0.5f) * 100 / width);
+			particles->a_x[index] = a.x;
+			particles->a_y[index] = a.y;
+			particles->flags[index] = PARTICLE_FLAG_PASSTHROUGH | PARTICLE_FLAG_IMMUNE_TO_WALL;
+			continue;
+		}
+
+		struct fx_particle *fx = push_fx_particle(game);
+		if (!fx)
+			continue;
+
+		u16 width = (u16)random_int(series, 4, 8);
+		struct v2 a = v2((random_f32(series) - 0.5f) * 100 / width, (random_f32(series) - 0.5f) * 100 / width);
+		fx->p = location;
+		fx->v = a;
+		fx->accel = len_v2(a);
+		fx->color = (u8)color;
+		fx->size = (u8)width;
+	}
+}
+
+static void
+spawn_fireball_trail(struct game_state *game, struct random_series *series, struct v2 location, u32 count)
+{
+	u32 more_p = count;
+	while ((more_p--)) {
+		struct fx_particle *trail = push_fx_particle(game);
+		if (!trail)
+			continue;
+
+		trail->size = (u8)random_int(series, 8, 16);
+
+		f32 r = random_f32(series);
+		if (r < 0.2f)
+			trail->color = 0;
+		else if (r < 0.4f)
+			trail->color = 7;
+		else
+			trail->color = 2;
+
+		trail->angle = (u8)(random_f32(series) * 255);
+		trail->p = location;
+		trail->v = v2((random_f32(series) - 0.5f) , (random_f32(series) - 0.5f));
 	}
 }
 
@@ -1543,7 +2967,7 @@ populate_cards(struct game_state *game)
 	for (u32 i = 0; i < game->card_count; ++i) {
 		enum card_type card_type;
 		for (;;) {
-			card_type = (enum card_type)(random_int(0, 6));
+			card_type = (enum card_type)(random_int(&game->random, 0, 6));
 			bool duplicate = false;
 			for (u32 j = 0; j < i; ++j)
 				if (game->cards[j].type == card_type)
@@ -1597,10 +3021,8 @@ complete_card_select_mode(struct game_state *game)
 {
 	struct card card = game->cards[game->selected_card];
 
-	if (find_entity_by_id(game, game->player_id, &game->player_index) &&
-	    game->entities[game->player_index].part_count &&
-	    game->entities[game->player_index].part_count < MAX_ENTITY_PART_COUNT) {
-		struct entity *player = game->entities + game->player_index;
+	struct entity *player = find_player(game);
+	if (player && player->part_count && player->part_count < MAX_ENTITY_PART_COUNT) {
 		switch (card.type) {
 		case REPAIR_CARD:
 			for (u32 i = 0; i < player->part_count; ++i)
@@ -1608,7 +3030,7 @@ complete_card_select_mode(struct game_state *game)
 			break;
 
 		case UPGRADE_HP_CARD: {
-			u32 part_index = (u32)(random_int(0, player->part_count));
+			u32 part_index = (u32)(random_int(&game->random, 0, player->part_count));
 			struct entity_part *p = player->parts + part_index;
 
 			u16 max_hp = p->max_hp;
@@ -1622,7 +3044,7 @@ complete_card_select_mode(struct game_state *game)
 		} break;
 
 		case UPGRADE_WEAPON_CARD: {
-			u32 part_index = (u32)(random_int(0, player->part_count));
+			u32 part_index = (u32)(random_int(&game->random, 0, player->part_count));
 			struct entity_part *p = player->parts + part_index;
 
 			u32 next_rate = (u32)(p->fire_rate + 2);
@@ -1633,7 +3055,9 @@ complete_card_select_mode(struct game_state *game)
 		} break;
 
 		case LIGHTNING_CARD: {
-			struct entity_part *p = push_entity_part(player, 40, 20, 9, 0);
+			struct entity_part *p = push_entity_part(game, player, 40, 20, 9, 0);
+			if (!p)
+				break;
 			p->internal_collisions = true;
 			p->stiffness = 2;
 			/* p->mass = 1; */
@@ -1644,7 +3068,9 @@ complete_card_select_mode(struct game_state *game)
 		} break;
 
 		case FIREBALL_CARD: {
-			struct entity_part *p = push_entity_part(player, 50, 20, 5, 0);
+			struct entity_part *p = push_entity_part(game, player, 50, 20, 5, 0);
+			if (!p)
+				break;
 			p->internal_collisions = true;
 			p->stiffness = 2;
 			/* p->mass = 1; */
@@ -1655,7 +3081,9 @@ complete_card_select_mode(struct game_state *game)
 		} break;
 
 		case TURRET_CARD: {
-			struct entity_part *p = push_entity_part(player, 40, 20, 0, 0);
+			struct entity_part *p = push_entity_part(game, player, 40, 20, 0, 0);
+			if (!p)
+				break;
 			p->internal_collisions = true;
 			p->stiffness = 2;
 			/* p->mass = 1; */
@@ -1679,8 +3107,8 @@ goto_level(struct game_state *game, u32 level)
 	game->spawn_bag_offset = 0;
 	game->spawn_group = 0;
 
-	if (!find_entity_by_id(game, game->player_id, &game->player_index)) {
-		game->entity_count = 0;
+	if (!find_player(game)) {
+		remove_all_entities(game);
 		game->score = 0;
 		push_spawn_item(game, ENTITY_PLAYER, 0, 0);
 
@@ -1700,7 +3128,7 @@ goto_level(struct game_state *game, u32 level)
 	/* push_spawn_item(game, ENTITY_SIMPLE, 0, 0); */
 	for (u32 i = 0; i < 4; ++i) {
 		difficulty += i;
-		u32 enemy_count = (u32)(random_int(1, 5));
+		u32 enemy_count = (u32)(random_int(&game->random, 1, 5));
 		u32 difficult_per_enemy = (u32)(difficulty / enemy_count);
 		if (difficult_per_enemy < 1)
 			difficult_per_enemy = 1;
@@ -1822,98 +3250,262 @@ goto_level(struct game_state *game, u32 level)
 	game->time_speed_up = 0;
 }
 
+static u8
+collision_grid_coord(f32 v, u32 cell_count)
+{
+	/* NOTE(omid): NaN lands in cell 0; it never passes the box test anyway. */
+	if (!(v >= 0))
+		return 0;
+
+	u32 cell = (u32)(v / COLLISION_GRID_CELL_SIZE);
+	return (u8)(cell < cell_count ? cell : cell_count - 1);
+}
+
+static struct collision_grid_rect
+compute_collision_grid_rect(struct v2 p, f32 extent_x, f32 extent_y)
+{
+	struct collision_grid_rect result;
+	result.x0 = collision_grid_coord(p.x - extent_x, COLLISION_GRID_WIDTH);
+	result.y0 = collision_grid_coord(p.y - extent_y, COLLISION_GRID_HEIGHT);
+	result.x1 = collision_grid_coord(p.x + extent_x, COLLISION_GRID_WIDTH);
+	result.y1 = collision_grid_coord(p.y + extent_y, COLLISION_GRID_HEIGHT);
+	return result;
+}
 
 static void
-begin_game_frame(struct game_state *game)
+insert_into_collision_grid(struct collision_grid *grid, u32 entity_index, u32 part_index, struct collision_grid_rect rect)
 {
-	game->event_count = 0;
+	for (u32 y = rect.y0; y <= rect.y1; ++y) {
+		for (u32 x = rect.x0; x <= rect.x1; ++x) {
+			if (grid->entry_count >= MAX_COLLISION_GRID_ENTRY_COUNT) {
+				grid->overflowed = true;
+				return;
+			}
 
-	/* NOTE(omid): Clean-up dead entities and initialize the live ones. */
-	if (game->game_over) {
-		for (u32 i = 0; i < game->entity_count; ++i) {
-			struct entity *entity = game->entities + i;
-			for (u32 j = 0; j < entity->part_count; ++j)
-				entity->parts[j].disposed = true;
+			u32 index = grid->entry_count++;
+			struct collision_grid_entry *entry = grid->entries + index;
+			entry->entity_index = (u16)entity_index;
+			entry->part_index = (u8)part_index;
+			entry->next = grid->cells[y][x];
+			grid->cells[y][x] = index;
 		}
 	}
+}
 
-	u32 entity_index = 0;
-	while (entity_index < game->entity_count) {
-		struct entity *entity = game->entities + entity_index;
-		entity->suspended_for_frame = false;
-
-		if (entity->expire && entity->expiration_t < game->time)
-			entity->disposed = true;
+static void
+sync_collision_grid_part(struct collision_grid *grid, u32 entity_index, u32 part_index, const struct entity_part *part)
+{
+	/* NOTE(omid): Parts are binned over their full Minkowski half-extent
+	 * against any other part (width, not width / 2), padded by a pixel.
+	 * A part that moves out of its binned rect is inserted again; stale
+	 * entries are harmless since the box test reads the live position. */
+	if (grid->overflowed)
+		return;
 
-		if (entity->part_count == 0)
-			entity->disposed = true;
+	while (grid->entity_count <= entity_index)
+		grid->binned_part_count[grid->entity_count++] = 0;
 
-		if (entity->disposed) {
-			if (entity->id == game->player_id)
-				game->game_over = true;
+	struct collision_grid_rect rect = compute_collision_grid_rect(part->p, part->width + 1.0f, part->height + 1.0f);
 
-			game->entities[entity_index] = game->entities[--game->entity_count];
-			game->entities[entity_index].index = entity_index;
-			continue;
+	if (part_index < grid->binned_part_count[entity_index]) {
+		struct collision_grid_rect binned = grid->binned[entity_index][part_index];
+		if (part->disposed)
+			return;
+		if (rect.x0 >= binned.x0 && rect.x1 <= binned.x1 && rect.y0 >= binned.y0 && rect.y1 <= binned.y1)
+			return;
+	} else {
+		grid->binned_part_count[entity_index] = (u8)(part_index + 1);
+		if (part->disposed) {
+			struct collision_grid_rect empty = { 1, 1, 0, 0 };
+			grid->binned[entity_index][part_index] = empty;
+			return;
 		}
+	}
 
-		/* NOTE(omid): Recursively dispose child parts of disposed parents. */
-		if (false) {
-			for (;;) {
-				bool found_child_to_dispose = false;
-				for (u32 i = 0; i < entity->part_count; ++i) {
-					struct entity_part *part = entity->parts + i;
-					if (part->disposed)
-						continue;
+	grid->binned[entity_index][part_index] = rect;
+	insert_into_collision_grid(grid, entity_index, part_index, rect);
+}
 
-					if (part->parent_index == part->index)
-						continue;
+static void
+sync_collision_grid_from(struct game_state *game, u32 first_entity_index)
+{
+	for (u32 entity_index = first_entity_index; entity_index < game->entity_count; ++entity_index) {
+		const struct entity *entity = game->entities + entity_index;
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index)
+			sync_collision_grid_part(&game->collision_grid, entity_index, part_index, entity->parts + part_index);
+	}
+}
 
-					if (entity->parts[part->parent_index].disposed)
-						found_child_to_dispose = part->disposed = true;
-				}
+static void
+sync_collision_grid(struct game_state *game)
+{
+	sync_collision_grid_from(game, 0);
+}
 
-				if (!found_child_to_dispose)
-					break;
-			}
-		} else {
-			for (;;) {
-				bool moved_child = false;
-				for (u32 i = 0; i < entity->part_count; ++i) {
-					struct entity_part *part = entity->parts + i;
-					if (part->disposed)
-						continue;
-
-					if (part->parent_index == part->index)
-						continue;
-
-					if (entity->parts[part->parent_index].disposed) {
-						if (part->parent_index == 0)
-							part->disposed = true;
-						else
-							part->parent_index = entity->parts[part->parent_index].parent_index;
-						moved_child = true;
-					}
-				}
+static void
+build_collision_grid(struct game_state *game)
+{
+	struct collision_grid *grid = &game->collision_grid;
 
-				if (!moved_child)
-					break;
+	ZERO_STRUCT(grid->cells);
+	/* NOTE(omid): Entry 0 is the end-of-list sentinel. */
+	grid->entry_count = 1;
+	grid->overflowed = false;
+	grid->entity_count = 0;
+
+	sync_collision_grid(game);
+}
+
+static void
+unlink_entity_part_child(struct entity *entity, u16 parent_index, u16 child_index)
+{
+	u16 *link = &entity->parts[parent_index].first_child;
+	while (*link != child_index) {
+		assert(*link != ENTITY_PART_NONE);
+		link = &entity->parts[*link].next_sibling;
+	}
+	*link = entity->parts[child_index].next_sibling;
+}
+
+static void
+set_entity_part_subtree_depth(struct entity *entity, u16 part_index, u16 depth)
+{
+	u16 stack[MAX_ENTITY_PART_COUNT];
+	u32 stack_count = 0;
+
+	entity->parts[part_index].depth = depth;
+	stack[stack_count++] = part_index;
+	while (stack_count) {
+		const struct entity_part *part = entity->parts + stack[--stack_count];
+		for (u16 child_index = part->first_child; child_index != ENTITY_PART_NONE; child_index = entity->parts[child_index].next_sibling) {
+			entity->parts[child_index].depth = part->depth + 1;
+			stack[stack_count++] = child_index;
+		}
+	}
+}
+
+static void
+reparent_orphaned_entity_parts(struct entity *entity)
+{
+	struct entity_part *parts = entity->parts;
+	if (!entity->part_count)
+		return;
+
+	/* NOTE(omid): Every chain ends at the root part, losing it takes
+	 * the whole entity. */
+	if (parts[0].disposed) {
+		for (u32 i = 0; i < entity->part_count; ++i)
+			parts[i].disposed = true;
+		return;
+	}
+
+	/* NOTE(omid): Live parts under a disposed chain move up to the
+	 * nearest live ancestor, bringing their own subtrees along. Only the
+	 * disposed parts and the live parts right below them are visited. */
+	u16 stack[MAX_ENTITY_PART_COUNT];
+	for (u16 top_index = 0; top_index < entity->part_count; ++top_index) {
+		const struct entity_part *top = parts + top_index;
+		if (!top->disposed || parts[top->parent_index].disposed)
+			continue;
+
+		u16 ancestor_index = top->parent_index;
+		unlink_entity_part_child(entity, ancestor_index, top_index);
+
+		u32 stack_count = 0;
+		stack[stack_count++] = top_index;
+		while (stack_count) {
+			struct entity_part *dead = parts + stack[--stack_count];
+			u16 child_index = dead->first_child;
+			dead->first_child = ENTITY_PART_NONE;
+
+			while (child_index != ENTITY_PART_NONE) {
+				struct entity_part *child = parts + child_index;
+				u16 next_index = child->next_sibling;
+				if (child->disposed) {
+					stack[stack_count++] = child_index;
+				} else {
+					child->parent_index = ancestor_index;
+					child->next_sibling = parts[ancestor_index].first_child;
+					parts[ancestor_index].first_child = child_index;
+					set_entity_part_subtree_depth(entity, child_index, parts[ancestor_index].depth + 1);
+				}
+				child_index = next_index;
 			}
 		}
+	}
+}
+
+static void
+move_entity_part(struct entity *entity, u16 from_index, u16 to_index)
+{
+	/* NOTE(omid): Disposed parts are already out of every live child
+	 * list, only a live part has links pointing at it. */
+	struct entity_part *part = entity->parts + from_index;
+	if (from_index != to_index && !part->disposed) {
+		if (part->parent_index != from_index) {
+			u16 *link = &entity->parts[part->parent_index].first_child;
+			while (*link != from_index)
+				link = &entity->parts[*link].next_sibling;
+			*link = to_index;
+		}
+
+		for (u16 child_index = part->first_child; child_index != ENTITY_PART_NONE; child_index = entity->parts[child_index].next_sibling)
+			entity->parts[child_index].parent_index = to_index;
+	}
+
+	entity->parts[to_index] = *part;
+	entity->parts[to_index].index = to_index;
+}
+
+static void
+begin_game_frame(struct game_state *game)
+{
+	game->event_count = 0;
+
+	/* NOTE(omid): Clean-up dead entities and initialize the live ones. */
+	if (game->game_over) {
+		for (u32 i = 0; i < game->entity_count; ++i) {
+			struct entity *entity = game->entities + i;
+			for (u32 j = 0; j < entity->part_count; ++j)
+				entity->parts[j].disposed = true;
+		}
+	}
+
+	u16 origin[MAX_ENTITY_COUNT];
+	u32 old_entity_count = game->entity_count;
+	for (u32 i = 0; i < old_entity_count; ++i)
+		origin[i] = (u16)i;
+
+	u32 entity_index = 0;
+	while (entity_index < game->entity_count) {
+		struct entity *entity = game->entities + entity_index;
+		entity->suspended_for_frame = false;
+
+		if (entity->expire && entity->expiration_t < game->time)
+			entity->disposed = true;
+
+		if (entity->part_count == 0)
+			entity->disposed = true;
+
+		if (entity->disposed) {
+			if (same_entity(entity->handle, game->player))
+				game->game_over = true;
+
+			origin[entity_index] = origin[game->entity_count - 1];
+			remove_entity(game, entity_index);
+			continue;
+		}
+
+		reparent_orphaned_entity_parts(entity);
 
 		u16 part_index = 0;
 		while (part_index < entity->part_count) {
 			struct entity_part *part = entity->parts + part_index;
 			if (part->disposed) {
-				struct entity_part_owner owner = { .direct = true, .entity_id = entity->id };
-				spawn_debris(game, owner, part->color, part->p, part->width + part->height, true);
+				struct entity_part_owner owner = { .direct = true, .entity = entity->handle };
+				spawn_debris(game, &entity->random, owner, part->color, part->p, part->width + part->height, true);
 
-				for (u32 i = 0; i < entity->part_count; ++i)
-					if (entity->parts[i].parent_index == (entity->part_count - 1))
-						entity->parts[i].parent_index = part_index;
-
-				entity->parts[part_index] = entity->parts[--entity->part_count];
-				entity->parts[part_index].index = part_index;
+				move_entity_part(entity, --entity->part_count, part_index);
 			} else {
 				/* NOTE(omid): Init part for the new frame. */
 				part->suspended_for_frame = false;
@@ -1927,18 +3519,19 @@ begin_game_frame(struct game_state *game)
 		++entity_index;
 	}
 
+	if (game->entity_count != old_entity_count)
+		remap_entity_z_order(game, origin, old_entity_count);
+
 	u32 particle_index = 0;
-	while (particle_index < game->particle_count) {
-		struct particle *particle = game->particles + particle_index;
-		if (particle->part.disposed) {
-			game->particles[particle_index] = game->particles[--game->particle_count];
+	while (particle_index < game->particles.count) {
+		if (game->particles.flags[particle_index] & PARTICLE_FLAG_DISPOSED) {
+			remove_particle(&game->particles, particle_index);
 		} else {
 			++particle_index;
 		}
 	}
 
-	for (u32 i = 0; i < game->entity_count; i++)
-		game->entity_index_by_z[i] = i;
+	build_collision_grid(game);
 }
 
 
@@ -1956,13 +3549,21 @@ spawn_next_group(struct game_state *game)
 		struct entity *entity = 0;
 		switch (item.type) {
 		case ENTITY_PLAYER:
-			entity = init_player(push_entity(game));
-			game->player_id = entity->id;
-			game->player_index = entity->index;
+			entity = push_entity(game);
+			if (init_player(game, entity)) {
+				game->player = entity->handle;
+			} else {
+				pop_entity(game, entity);
+				game->game_over = true;
+			}
 			break;
 
 		case ENTITY_ENEMY:
-			entity = init_enemy(push_entity(game), item.param);
+			/* NOTE(omid): The part pool can run dry, drop the enemy
+			 * instead of spawning it half built. */
+			entity = push_entity(game);
+			if (!init_enemy(game, entity, item.param))
+				pop_entity(game, entity);
 			break;
 		}
 
@@ -2030,21 +3631,12 @@ run_level_scenario_control(struct game_state *game)
 		if (game->card_select_mode || (get_time_of_next_spawn(game, &next_spawn) && (next_spawn - game->time) < 1)) { /* < game->level_begin_t) { */
 			game->next_tunnel_depth = 50;
 		} else if (fabsf(game->current_tunnel_depth - game->next_tunnel_depth) < 0.001f) {
-			game->next_tunnel_depth = 100 + random_f32() * game->tunnel_difficulty;
+			game->next_tunnel_depth = 100 + random_f32(&game->random) * game->tunnel_difficulty;
 		}
 		game->current_tunnel_depth += (game->next_tunnel_depth - game->current_tunnel_depth) * 0.1f;
 	}
 }
 
-static struct entity *
-find_player(struct game_state *game)
-{
-	if (!find_entity_by_id(game, game->player_id, &game->player_index))
-		return 0;
-
-	return game->entities + game->player_index;
-}
-
 static void
 apply_user_input(struct game_state *game, const struct input_state *input)
 {
@@ -2060,15 +3652,11 @@ apply_user_input(struct game_state *game, const struct input_state *input)
 			else
 				game->selected_card = (game->selected_card - 1) % game->card_count;
 
-			struct sound *s = push_sound(game, SAW, 440, 0.5f);
-			if (s)
-				s->once = true;
+			queue_sound(game, SAW, 440, 0.5f);
 		}
 		if (input->dright > 0) {
 			game->selected_card = (game->selected_card + 1) % game->card_count;
-			struct sound *s = push_sound(game, SAW, 440, 0.5f);
-			if (s)
-				s->once = true;
+			queue_sound(game, SAW, 440, 0.5f);
 		}
 
 		if (input->dstart > 0) {
@@ -2101,10 +3689,8 @@ apply_user_input(struct game_state *game, const struct input_state *input)
 
 			game->shield_active = input->action;
 
-			s32 mouse_x, mouse_y;
-			u32 mouse_buttons = SDL_GetMouseState(&mouse_x, &mouse_y);
-			if (mouse_buttons & SDL_BUTTON(SDL_BUTTON_LEFT)) {
-				struct v2 m = v2((f32)mouse_x, (f32)mouse_y);
+			if (input->mouse_buttons & SDL_BUTTON(SDL_BUTTON_LEFT)) {
+				struct v2 m = v2((f32)input->mouse_x, (f32)input->mouse_y);
 				struct v2 d = sub_v2(m, root->p);
 				root->a = add_v2(root->a, scale_v2(normalize_v2(d), 2));
 			}
@@ -2131,10 +3717,10 @@ entity_should_check_target(struct game_state *game, struct entity *entity)
 static void
 update_roaming_ai(struct entity *entity)
 {
-	f32 r1 = (f32)(random_int(0, WINDOW_WIDTH / 2));
-	f32 r2 = (f32)(random_int(0, WINDOW_HEIGHT / 2));
+	f32 r1 = (f32)(random_int(&entity->random, 0, WINDOW_WIDTH / 2));
+	f32 r2 = (f32)(random_int(&entity->random, 0, WINDOW_HEIGHT / 2));
 
-	f32 a = (f32)random_f32() * 2 * 3.14f;
+	f32 a = (f32)random_f32(&entity->random) * 2 * 3.14f;
 	entity->target = add_v2(screen_center, v2(r1 * cosf(a), r2 * sinf(a)));
 	entity->has_target = true;
 }
@@ -2189,49 +3775,54 @@ update_water_eater_ai(struct game_state *game, struct entity *entity)
 }
 #endif
 
-static struct particle *
+static u32
 fire_projectile(struct game_state *game, struct entity *entity, struct entity_part *part, u16 type, u16 width, u16 height)
 {
-	struct particle *particle = push_particle(game, type);
-	if (!particle)
-		return 0;
-
-	struct entity_part *p = &particle->part;
-	particle->type = type;
-	particle->owner_id = entity->id;
-	particle->owner_index =  (u16)entity->index;
+	/* NOTE(omid): Enemies only fire while there is a player to aim at. */
+	struct entity *player = find_player(game);
+	if (!(entity->type & ENTITY_PLAYER) && !player)
+		return PARTICLE_INDEX_NONE;
+
+	u32 index = push_particle(game, type);
+	if (index == PARTICLE_INDEX_NONE)
+		return PARTICLE_INDEX_NONE;
+
+	struct particle_store *particles = &game->particles;
+	struct particle *particle = particles->info + index;
+	particle->owner = entity->handle;
 	particle->owner_part_index = part->index;
-	p->length = 1;
-	p->width = width;
-	p->height = height;
-	p->mass = p->width * p->height * 100;
-	/* p->color = part->dmg & PARTICLE_LIGHTNING_GUIDE ? UINT8_MAX : 2; */
-	p->color = 2;
-	p->p = part->p;
+	particles->width[index] = width;
+	particles->height[index] = height;
+	particle->mass = width * height * 100;
+	/* particle->color = part->dmg & PARTICLE_LIGHTNING_GUIDE ? UINT8_MAX : 2; */
+	particle->color = 2;
+	particles->p_x[index] = part->p.x;
+	particles->p_y[index] = part->p.y;
 
+	struct v2 v;
 	if (entity->type & ENTITY_PLAYER) {
-		p->v = v2(0, -100);
+		v = v2(0, -100);
 	} else {
-		struct v2 player_p = game->entities[game->player_index].parts->p;
-		p->v = scale_v2(normalize_v2(sub_v2(player_p, p->p)), 10);
+		struct v2 player_p = player->parts->p;
+		v = scale_v2(normalize_v2(sub_v2(player_p, part->p)), 10);
 	}
+	particles->v_x[index] = v.x;
+	particles->v_y[index] = v.y;
 
 	if (part->dmg & PARTICLE_FAT_BULLET) {
-		p->height = 16;
-		p->mass = p->width * p->height * 100;
-		p->color = 4;
-		p->angle = atan2f(p->v.y, p->v.x) + 3.14f / 2;
+		particles->height[index] = 16;
+		particle->mass = width * 16 * 100;
+		particle->color = 4;
+		particle->angle = atan2f(v.y, v.x) + 3.14f / 2;
 	}
 
-	p->passthrough = false;
-	p->dmg = 1;
-	p->die_at_screen_edge = true;
-	p->immune_to_wall = false;
+	particle->dmg = 1;
+	particles->flags[index] = PARTICLE_FLAG_DIE_AT_SCREEN_EDGE;
 
-	return particle;
+	return index;
 }
 
-static struct particle *
+static u32
 fire_guided_gun(struct game_state *game, struct entity *entity, struct entity_part *part, u16 type)
 {
 	struct v2 o = part->p;
@@ -2258,16 +3849,18 @@ fire_guided_gun(struct game_state *game, struct entity *entity, struct entity_pa
 	}
 
 	if (min_dist < 100000000) {
-		struct particle *particle = fire_projectile(game, entity, part, PARTICLE_BULLET | type, 8, 8);
-		if (!particle)
-			return 0;
-
-		particle->part.v = scale_v2(normalize_v2(v), 50);
-		particle->part.color = 0;  /* UINT8_MAX; */
-		return particle;
+		u32 index = fire_projectile(game, entity, part, PARTICLE_BULLET | type, 8, 8);
+		if (index == PARTICLE_INDEX_NONE)
+			return PARTICLE_INDEX_NONE;
+
+		struct v2 guided_v = scale_v2(normalize_v2(v), 50);
+		game->particles.v_x[index] = guided_v.x;
+		game->particles.v_y[index] = guided_v.y;
+		game->particles.info[index].color = 0;  /* UINT8_MAX; */
+		return index;
 	}
 
-	return 0;
+	return PARTICLE_INDEX_NONE;
 }
 
 
@@ -2280,40 +3873,69 @@ fire_lightning_gun(struct game_state *game, struct entity *entity, struct entity
 static void
 fire_fireball(struct game_state *game, struct entity *entity, struct entity_part *part)
 {
-	struct particle *particle = fire_guided_gun(game, entity, part, PARTICLE_FIREBALL);
-	if (!particle)
+	u32 index = fire_guided_gun(game, entity, part, PARTICLE_FIREBALL);
+	if (index == PARTICLE_INDEX_NONE)
 		return;
-	particle->part.width = particle->part.height = 32;
-	particle->part.mass = particle->part.width * particle->part.height * 100;
-	particle->part.color = 7;
-	particle->part.dmg = 10;
+
+	struct particle_store *particles = &game->particles;
+	particles->width[index] = particles->height[index] = 32;
+	particles->info[index].mass = 32 * 32 * 100;
+	particles->info[index].color = 7;
+	particles->info[index].dmg = 10;
 }
 
 static void
 fire_regular(struct game_state *game, struct entity *entity, struct entity_part *part)
 {
-	struct particle *particle = fire_projectile(game, entity, part, PARTICLE_BULLET, 8, 8);
-	if (!particle)
-		return;
+	fire_projectile(game, entity, part, PARTICLE_BULLET, 8, 8);
 }
 
 static void
 fire_fat(struct game_state *game, struct entity *entity, struct entity_part *part)
 {
-	struct particle *particle = fire_projectile(game, entity, part, PARTICLE_BULLET, 8, 8);
-	if (!particle)
+	u32 index = fire_projectile(game, entity, part, PARTICLE_BULLET, 8, 8);
+	if (index == PARTICLE_INDEX_NONE)
 		return;
-	particle->part.height = 16;
-	particle->part.mass = particle->part.width * particle->part.height * 100;
-	particle->part.color = 4;
-	particle->part.dmg = 2;
+
+	struct particle_store *particles = &game->particles;
+	particles->height[index] = 16;
+	particles->info[index].mass = 8 * 16 * 100;
+	particles->info[index].color = 4;
+	particles->info[index].dmg = 2;
 }
 
 
 static void
-update_entity_ai(struct game_state *game)
+fire_entity_part(struct game_state *game, struct entity *entity, struct entity_part *part)
 {
-	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+	if (part->dmg & PARTICLE_LIGHTNING_GUIDE)
+		fire_lightning_gun(game, entity, part);
+	else if (part->dmg & PARTICLE_FIREBALL)
+		fire_fireball(game, entity, part);
+	else if (part->dmg & PARTICLE_FAT_BULLET)
+		fire_fat(game, entity, part);
+	else if (part->dmg & PARTICLE_BULLET)
+		fire_regular(game, entity, part);
+}
+
+static s32
+compare_u32(const void *x, const void *y)
+{
+	u32 a = *(const u32 *)x;
+	u32 b = *(const u32 *)y;
+	return a < b ? -1 : a > b;
+}
+
+/* NOTE(omid): Touches only the entities of its range; firing pushes
+ * particles and is requested here, then done in order by
+ * update_entity_ai. */
+static void
+update_entity_ai_range(void *data, u32 worker_index, u32 begin, u32 end)
+{
+	struct game_state *game = data;
+	struct fire_requests *fire_requests = game->fire_requests + worker_index;
+
+	for (u32 entity_index = begin; entity_index < end; ++entity_index) {
 		struct entity *entity = game->entities + entity_index;
 		struct entity_part *head = entity->parts;
 		assert(!entity->disposed);
@@ -2381,14 +4003,7 @@ update_entity_ai(struct game_state *game)
 				if (game->time < part->next_fire_t)
 					continue;
 
-				if (part->dmg & PARTICLE_LIGHTNING_GUIDE)
-					fire_lightning_gun(game, entity, part);
-				else if (part->dmg & PARTICLE_FIREBALL)
-					fire_fireball(game, entity, part);
-				else if (part->dmg & PARTICLE_FAT_BULLET)
-					fire_fat(game, entity, part);
-				else if (part->dmg & PARTICLE_BULLET)
-					fire_regular(game, entity, part);
+				fire_requests->keys[fire_requests->count++] = (entity_index << 8) | part_index;
 
 				f32 r = (f32)4.25f / part->fire_rate;
 				part->next_fire_t = game->time + r;
@@ -2410,18 +4025,18 @@ update_entity_ai(struct game_state *game)
 		/* 	break; */
 		/* } */
 
-		if (entity->target_entity_id && find_entity_by_id(game, entity->target_entity_id, &entity->target_entity_index)) {
-			struct entity *target = game->entities + entity->target_entity_index;
+		struct entity *target = find_entity(game, entity->target_entity);
+		if (target) {
 			if (target->disposed || (target->expire && game->time > target->expiration_t)) {
 				entity->has_target = false;
-				entity->target_entity_id = 0;
+				ZERO_STRUCT(entity->target_entity);
 			} else {
 				entity->target = target->parts[0].p;
 				entity->has_target = true;
 			}
-		} else if (entity->target_entity_id) {
+		} else if (entity->target_entity.generation) {
 			entity->has_target = false;
-			entity->target_entity_id = 0;
+			ZERO_STRUCT(entity->target_entity);
 		}
 
 		if (entity->has_target) {
@@ -2432,9 +4047,36 @@ update_entity_ai(struct game_state *game)
 }
 
 static void
-update_spring_physics(struct game_state *game)
+update_entity_ai(struct game_state *game)
 {
-	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+	for (u32 i = 0; i < MAX_JOB_WORKER_COUNT; ++i)
+		game->fire_requests[i].count = 0;
+
+	parallel_for(&job_system, game->entity_count, ENTITY_JOB_CHUNK_SIZE, update_entity_ai_range, game);
+
+	/* NOTE(omid): Fire in (entity, part) order whichever worker saw the
+	 * request, so particles are pushed in the same order every run. */
+	u32 fire_count = 0;
+	for (u32 i = 0; i < MAX_JOB_WORKER_COUNT; ++i) {
+		const struct fire_requests *fire_requests = game->fire_requests + i;
+		memcpy(game->fire_order + fire_count, fire_requests->keys, sizeof(u32) * fire_requests->count);
+		fire_count += fire_requests->count;
+	}
+	qsort(game->fire_order, fire_count, sizeof(u32), compare_u32);
+
+	for (u32 i = 0; i < fire_count; ++i) {
+		struct entity *entity = game->entities + (game->fire_order[i] >> 8);
+		fire_entity_part(game, entity, entity->parts + (game->fire_order[i] & 0xFF));
+	}
+}
+
+static void
+update_spring_physics_range(void *data, u32 worker_index, u32 begin, u32 end)
+{
+	struct game_state *game = data;
+	(void)worker_index;
+
+	for (u32 entity_index = begin; entity_index < end; ++entity_index) {
 		struct entity *entity = game->entities + entity_index;
 		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
 			struct entity_part *part = entity->parts + part_index;
@@ -2457,132 +4099,231 @@ update_spring_physics(struct game_state *game)
 	}
 }
 
+static void
+update_spring_physics(struct game_state *game)
+{
+	/* NOTE(omid): Springs only pull parts of the same entity. */
+	parallel_for(&job_system, game->entity_count, ENTITY_JOB_CHUNK_SIZE, update_spring_physics_range, game);
+}
+
 
 static void
-check_for_collisions_against_entities(struct game_state *game, struct entity_part *part, struct entity_part_owner owner, struct v2 *new_p, struct v2 v)
+push_particle_hit(struct particle_hits *hits, u32 particle_index, u32 target_index, u32 target_part_index, u32 flags, struct v2 force, struct v2 p)
 {
-	struct entity *entity = 0;
-	if (find_entity_by_id(game, owner.entity_id, &owner.entity_index))
-		entity = game->entities + owner.entity_index;
+	if (hits->count >= MAX_PARTICLE_HIT_COUNT) {
+		hits->overflowed = true;
+		return;
+	}
 
-	for (u32 other_index = 0; other_index < game->entity_count; ++other_index) {
-		struct entity *other = game->entities + other_index;
+	struct particle_hit *hit = hits->hits + hits->count;
+	hit->particle_index = particle_index;
+	hit->order = hits->count++;
+	hit->target_index = (u16)target_index;
+	hit->target_part_index = (u16)target_part_index;
+	hit->flags = flags;
+	hit->force = force;
+	hit->p = p;
+}
 
-		if (owner.entity_id == other->id && (!part->internal_collisions))
-			continue;
+/* NOTE(omid): With 'hits' the contact is only recorded, the other part
+ * and the command buffers are left alone. */
+static bool
+check_for_collision_against_entity_part(struct game_state *game,
+					struct entity_part *part,
+					struct entity_part_owner owner,
+					const struct entity *entity,
+					u32 other_index,
+					u32 other_part_index,
+					struct v2 *new_p,
+					struct v2 v,
+					struct particle_hits *hits)
+{
+	struct entity *other = game->entities + other_index;
 
-		if (other->z < 1)
-			continue;
+	if (same_entity(owner.entity, other->handle) && (!part->internal_collisions))
+		return false;
 
-		if (other->disposed)
-			continue;
+	if (other->z < 1)
+		return false;
 
-		if (owner.entity_id != other->id && entity && (entity->type & ENTITY_ENEMY) && (other->type & ENTITY_ENEMY))
-			continue;
+	if (other->disposed)
+		return false;
 
-		for (u32 other_part_index = 0; other_part_index < other->part_count; ++other_part_index) {
-			struct entity_part *other_part = other->parts + other_part_index;
+	if (!same_entity(owner.entity, other->handle) && entity && (entity->type & ENTITY_ENEMY) && (other->type & ENTITY_ENEMY))
+		return false;
 
-			if (other->id == owner.entity_id && (part->index == other_part_index || !other_part->internal_collisions))
-				continue;
+	struct entity_part *other_part = other->parts + other_part_index;
 
-			if (other_part->disposed)
-				continue;
+	if (same_entity(other->handle, owner.entity) && (part->index == other_part_index || !other_part->internal_collisions))
+		return false;
 
-			bool do_collision_response = false;
-
-			struct v2 tmp = v;
-			struct v2 tmp_p = *new_p;
-			if (test_collision_against_box(other_part, part, part->p, &tmp_p, &tmp)) {
-				do_collision_response = !part->passthrough && !other_part->passthrough;
-
-				if (!part->suspended_for_frame && !other->suspended_for_frame && !other_part->suspended_for_frame) {
-					if (!owner.direct) {
-						if (game->particles[owner.particle_index].type & PARTICLE_BULLET) {
-							if (other->id == game->player_id && game->shield_active && game->shield_energy > 0) {
-								spawn_debris(game, owner, 9, other_part->p, max_u(part->dmg, 10), false);
-								part->disposed = true;
-							} else {
-								if (other_part->hp > part->dmg)
-									other_part->hp -= part->dmg;
-								else
-									other_part->disposed = true;
-								other_part->hurt = 1;
-								part->disposed = true;
-
-								if (other->id != game->player_id)
-									game->score += part->dmg * 10;
-
-								if (!other_part->disposed)
-									spawn_debris(game, owner, other_part->color, other_part->p, max_u(part->dmg, 10), false);
-								else
-									game->score += other_part->max_hp * 100;
-							}
-
-							if ((game->particles[owner.particle_index].type & PARTICLE_LIGHTNING_GUIDE)) {
-								if (game->entity_count < MAX_ENTITY_COUNT)
-									init_lightning(push_entity(game), owner.entity_id, owner.entity_part_index, other->id, (u16)other_part_index, game->time + 0.5f);
-							}
-						}
-					}
+	if (other_part->disposed)
+		return false;
+
+	bool do_collision_response = false;
+	u32 hit_flags = 0;
+	struct v2 hit_force = v2(0, 0);
+
+	struct v2 tmp = v;
+	struct v2 tmp_p = *new_p;
+	if (test_collision_against_box(other_part, part, part->p, &tmp_p, &tmp)) {
+		do_collision_response = !part->passthrough && !other_part->passthrough;
+
+		if (!part->suspended_for_frame && !other->suspended_for_frame && !other_part->suspended_for_frame) {
+			if (!owner.direct) {
+				u16 particle_type = game->particles.type[owner.particle_index];
+				if (particle_type & PARTICLE_BULLET) {
+					if (hits)
+						hit_flags |= PARTICLE_HIT_DAMAGE;
+					else
+						push_damage_command(game, owner, other_index, other_part_index, part->dmg, particle_type);
+					part->disposed = true;
 				}
 			}
+		}
+	}
 
-			/* do_collision_response = false; */
+	/* do_collision_response = false; */
 
-			if (do_collision_response) {
-				*new_p = tmp_p;
-				/* struct v2 d = normalize_v2(sub_v2(op->p, part->p)); */
-				struct v2 d = normalize_v2(v);
-				f32 v1 = dot_v2(v, d);
-				f32 v2 = dot_v2(other_part->v, d);
-				f32 total_mass = part->mass + other_part->mass;
-				f32 dv = v1 - v2;
+	if (do_collision_response) {
+		*new_p = tmp_p;
+		/* struct v2 d = normalize_v2(sub_v2(op->p, part->p)); */
+		struct v2 d = normalize_v2(v);
+		f32 v1 = dot_v2(v, d);
+		f32 v2 = dot_v2(other_part->v, d);
+		f32 total_mass = part->mass + other_part->mass;
+		f32 dv = v1 - v2;
 
-				f32 f1 = -dv * other_part->mass / total_mass * 2;
-				f32 f2 = dv * part->mass / total_mass * 2;
+		f32 f1 = -dv * other_part->mass / total_mass * 2;
+		f32 f2 = dv * part->mass / total_mass * 2;
 
 #if 0
-				printf("Collision (%u,%u) <=> (%u,%u)\n", entity_index, part_index, other_index, other_part_index);
-				printf("\tV1: %f, V2: %f, M1: %f, M2: %f, DV: %f\n", (f64)v1, (f64)v2, (f64)part->mass, (f64)op->mass, (f64)dv);
-				printf("\tF1: %f, F2: %f\n", (f64)(f1), (f64)(f2));
+		printf("Collision (%u,%u) <=> (%u,%u)\n", entity_index, part_index, other_index, other_part_index);
+		printf("\tV1: %f, V2: %f, M1: %f, M2: %f, DV: %f\n", (f64)v1, (f64)v2, (f64)part->mass, (f64)op->mass, (f64)dv);
+		printf("\tF1: %f, F2: %f\n", (f64)(f1), (f64)(f2));
 #endif
-				part->force = add_v2(part->force, scale_v2(d, f1));
-				other_part->force = add_v2(other_part->force, scale_v2(d, f2));
+		part->force = add_v2(part->force, scale_v2(d, f1));
+		if (hits) {
+			hit_flags |= PARTICLE_HIT_PUSH;
+			hit_force = scale_v2(d, f2);
+		} else {
+			other_part->force = add_v2(other_part->force, scale_v2(d, f2));
+		}
+	}
+
+	if (hit_flags)
+		push_particle_hit(hits, owner.particle_index, other_index, other_part_index, hit_flags, hit_force, *new_p);
+
+	return part->disposed;
+}
+
+static void
+check_for_collisions_against_entities(struct game_state *game, struct entity_part *part, struct entity_part_owner owner, struct v2 *new_p, struct v2 v, struct particle_hits *hits)
+{
+	const struct entity *entity = find_entity(game, owner.entity);
+
+	/* NOTE(omid): Gather candidates from the grid and visit them in
+	 * (entity, part) order, so forces and the early out on disposal
+	 * happen exactly as in the full scan. An already disposed part still
+	 * resolves against the first candidate of the full scan, so it takes
+	 * the slow path along with grid or candidate overflow. */
+	const struct collision_grid *grid = &game->collision_grid;
+	if (!part->disposed && !grid->overflowed) {
+		u32 candidates[MAX_COLLISION_CANDIDATE_COUNT];
+		u32 candidate_count = 0;
+		bool candidates_overflowed = false;
+
+		struct collision_grid_rect rect = compute_collision_grid_rect(part->p, part->width + 1.0f, part->height + 1.0f);
+		for (u32 y = rect.y0; y <= rect.y1 && !candidates_overflowed; ++y) {
+			for (u32 x = rect.x0; x <= rect.x1 && !candidates_overflowed; ++x) {
+				for (u32 entry_index = grid->cells[y][x]; entry_index; entry_index = grid->entries[entry_index].next) {
+					if (candidate_count >= ARRAY_COUNT(candidates)) {
+						candidates_overflowed = true;
+						break;
+					}
+
+					const struct collision_grid_entry *entry = grid->entries + entry_index;
+					u32 key = ((u32)entry->entity_index << 8) | entry->part_index;
+
+					u32 insert_at = candidate_count;
+					while (insert_at && candidates[insert_at - 1] > key) {
+						candidates[insert_at] = candidates[insert_at - 1];
+						--insert_at;
+					}
+					candidates[insert_at] = key;
+					++candidate_count;
+				}
+			}
+		}
+
+		if (!candidates_overflowed) {
+			for (u32 i = 0; i < candidate_count; ++i) {
+				if (i && candidates[i] == candidates[i - 1])
+					continue;
+
+				u32 other_index = candidates[i] >> 8;
+				u32 other_part_index = candidates[i] & 0xFF;
+				if (other_index >= game->entity_count || other_part_index >= game->entities[other_index].part_count)
+					continue;
+
+				if (check_for_collision_against_entity_part(game, part, owner, entity, other_index, other_part_index, new_p, v, hits))
+					return;
 			}
+			return;
+		}
+	}
 
-			if (part->disposed)
+	for (u32 other_index = 0; other_index < game->entity_count; ++other_index) {
+		struct entity *other = game->entities + other_index;
+		for (u32 other_part_index = 0; other_part_index < other->part_count; ++other_part_index) {
+			if (check_for_collision_against_entity_part(game, part, owner, entity, other_index, other_part_index, new_p, v, hits))
 				return;
 		}
 	}
 }
 
-static bool
-check_for_collisions_against_tunnel_(struct game_state *game, struct entity_part *part, struct entity_part_owner owner)
+static void
+build_tunnel_profile(struct game_state *game)
 {
-	if (owner.direct && game->entities[owner.entity_index].z < 1)
-		return false;
-
-	struct v2 p = part->p;
+	struct tunnel_profile *profile = &game->tunnel_profile;
+	for (u32 row = 0; row < TUNNEL_PROFILE_ROW_COUNT; ++row) {
+		struct tunnel_segment s1 = game->tunnel_segments[(game->current_tunnel_segment - row) & (TUNNEL_SEGMENT_COUNT - 1)];
+		struct tunnel_segment s2 = game->tunnel_segments[(game->current_tunnel_segment - row - 1) & (TUNNEL_SEGMENT_COUNT - 1)];
+		profile->min_x[row] = (f32)(s1.left > s2.left ? s1.left : s2.left);
+		profile->max_x[row] = (f32)(WINDOW_WIDTH - (s1.right > s2.right ? s1.right : s2.right));
+	}
+}
 
-	u32 segment_1 = (u32)(p.y / TUNNEL_SEGMENT_THICKNESS);
-	u32 segment_2 = segment_1 + 1;
+static u32
+tunnel_profile_row(f32 y)
+{
+	f32 row = y / TUNNEL_SEGMENT_THICKNESS;
+	if (!(row >= 0))
+		return 0;
+	if (row >= TUNNEL_PROFILE_ROW_COUNT - 1)
+		return TUNNEL_PROFILE_ROW_COUNT - 1;
+	return (u32)row;
+}
 
-	struct tunnel_segment s1 = game->tunnel_segments[(game->current_tunnel_segment - segment_1) & (TUNNEL_SEGMENT_COUNT - 1)];
-	struct tunnel_segment s2 = game->tunnel_segments[(game->current_tunnel_segment - segment_2) & (TUNNEL_SEGMENT_COUNT - 1)];
+static bool
+hits_tunnel_wall(const struct game_state *game, struct v2 p, u16 width)
+{
+	u32 row = tunnel_profile_row(p.y);
+	f32 left = p.x - width / 2;
+	f32 right = p.x + width / 2;
+	return left < game->tunnel_profile.min_x[row] || right > game->tunnel_profile.max_x[row];
+}
 
-	f32 left = p.x - part->width / 2;
-	f32 right = p.x + part->width / 2;
-	if (left < s1.left)
-		return true;
-	else if (right > (WINDOW_WIDTH - s1.right))
-		return true;
-	else if (left < s2.left)
-		return true;
-	else if (right > (WINDOW_WIDTH - s2.right))
-		return true;
+static bool
+check_for_collisions_against_tunnel_(struct game_state *game, struct entity_part *part, struct entity_part_owner owner)
+{
+	if (owner.direct) {
+		const struct entity *entity = find_entity(game, owner.entity);
+		if (entity && entity->z < 1)
+			return false;
+	}
 
-	return false;
+	return hits_tunnel_wall(game, part->p, part->width);
 }
 
 static void
@@ -2610,37 +4351,31 @@ kill_entity_part_at_bounds(struct entity_part *part)
 }
 
 static void
-force_entity_part_within_tunnel(struct game_state *game, struct entity_part *part)
+force_within_tunnel(struct game_state *game, f32 *p_x, f32 p_y, f32 *v_x, f32 *a_x, u16 width)
 {
-	struct v2 p = part->p;
-
-	u32 segment_1 = (u32)(p.y / TUNNEL_SEGMENT_THICKNESS);
-	u32 segment_2 = segment_1 + 1;
-
-	struct tunnel_segment s1 = game->tunnel_segments[(game->current_tunnel_segment - segment_1) & (TUNNEL_SEGMENT_COUNT - 1)];
-	struct tunnel_segment s2 = game->tunnel_segments[(game->current_tunnel_segment - segment_2) & (TUNNEL_SEGMENT_COUNT - 1)];
-
-	f32 left = p.x - part->width / 2;
-	f32 right = p.x + part->width / 2;
-	if (left < s1.left) {
-		part->p.x = s1.left + part->width / 2;
-		part->v.x = -part->v.x * 0.4f;
-		part->a.x = 0;
-	} else if (right > (WINDOW_WIDTH - s1.right)) {
-		part->p.x = WINDOW_WIDTH - s1.right - part->width / 2;
-		part->v.x = -part->v.x * 0.4f;
-		part->a.x = 0;
-	} else if (left < s2.left) {
-		part->p.x = s2.left + part->width / 2;
-		part->v.x = -part->v.x * 0.4f;
-		part->a.x = 0;
-	} else if (right > (WINDOW_WIDTH - s2.right)) {
-		part->p.x = WINDOW_WIDTH - s2.right - part->width / 2;
-		part->v.x = -part->v.x * 0.4f;
-		part->a.x = 0;
+	u32 row = tunnel_profile_row(p_y);
+	f32 min_x = game->tunnel_profile.min_x[row];
+	f32 max_x = game->tunnel_profile.max_x[row];
+
+	f32 left = *p_x - width / 2;
+	f32 right = *p_x + width / 2;
+	if (left < min_x) {
+		*p_x = min_x + width / 2;
+		*v_x = -*v_x * 0.4f;
+		*a_x = 0;
+	} else if (right > max_x) {
+		*p_x = max_x - width / 2;
+		*v_x = -*v_x * 0.4f;
+		*a_x = 0;
 	}
 }
 
+static void
+force_entity_part_within_tunnel(struct game_state *game, struct entity_part *part)
+{
+	force_within_tunnel(game, &part->p.x, part->p.y, &part->v.x, &part->a.x, part->width);
+}
+
 static void
 force_entity_part_within_bounds(struct entity_part *part)
 {
@@ -2680,7 +4415,7 @@ update_newtonian_physics_for_part(struct game_state *game, struct entity_part *p
 
 	struct v2 new_p = add_v2(part->p, new_v);
 
-	check_for_collisions_against_entities(game, part, owner, &new_p, new_v);
+	check_for_collisions_against_entities(game, part, owner, &new_p, new_v, 0);
 	check_for_collisions_against_tunnel(game, part, owner);
 
 	if (len_v2(new_v) > 20)
@@ -2698,97 +4433,635 @@ update_newtonian_physics_for_part(struct game_state *game, struct entity_part *p
 }
 
 static void
-update_newtonian_physics(struct game_state *game)
+expire_particles_scalar(struct particle_store *particles, u32 begin, u32 end, f32 time)
 {
-	for (u16 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
-		struct entity *entity = game->entities + entity_index;
-		struct entity_part_owner owner = { .entity_id = entity->id, .entity_index = entity_index, .direct = true };
-		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
-			owner.entity_part_index = (u16)part_index;
-			struct entity_part *part = entity->parts + part_index;
-			update_newtonian_physics_for_part(game, part, owner);
-		}
+	for (u32 i = begin; i < end; ++i) {
+		u32 flags = particles->flags[i] & ~(u32)PARTICLE_FLAG_MOVING;
+		if (time > particles->expiration_t[i])
+			flags |= PARTICLE_FLAG_DISPOSED;
+		if (!(flags & PARTICLE_FLAG_DISPOSED))
+			flags |= PARTICLE_FLAG_MOVING;
+		particles->flags[i] = flags;
 	}
+}
 
-	for (u16 particle_index = 0; particle_index < game->particle_count; ++particle_index) {
-		struct particle *particle = game->particles + particle_index;
-
-		if (game->time > particle->expiration_t)
-			particle->part.disposed = true;
+static struct v2
+clamp_particle_speed(struct v2 v)
+{
+	if (len_v2(v) > 20)
+		v = scale_v2(normalize_v2(v), 20);
+	return v;
+}
 
-		if (particle->part.disposed)
+static void
+integrate_particles_scalar(struct particle_store *particles, u32 begin, u32 end)
+{
+	for (u32 i = begin; i < end; ++i) {
+		if (!(particles->flags[i] & PARTICLE_FLAG_MOVING))
 			continue;
 
-		if (particle->type == PARTICLE_EXPLOSION) {
-			particle->part.audio_gen = particle->expiration_t - game->time;
-		}
+		struct v2 v = clamp_particle_speed(v2(particles->v_x[i] + particles->a_x[i], particles->v_y[i] + particles->a_y[i]));
+		particles->next_p_x[i] = particles->p_x[i] + v.x;
+		particles->next_p_y[i] = particles->p_y[i] + v.y;
+		particles->v_x[i] = v.x;
+		particles->v_y[i] = v.y;
+	}
+}
 
-		if ((particle->type & PARTICLE_FIREBALL)) {
-			u32 more_p = 3;
-			while ((more_p--)) {
-				struct particle *pp = push_particle(game, PARTICLE_DEBRIS);
-				if (!pp)
-					return;
+static void
+bound_particles_scalar(struct particle_store *particles, u32 begin, u32 end)
+{
+	for (u32 i = begin; i < end; ++i) {
+		u32 flags = particles->flags[i];
+		if (!(flags & PARTICLE_FLAG_MOVING))
+			continue;
 
-				pp->expiration_t = game->time + 1;
-				struct entity_part *p = &pp->part;
-				pp->type = PARTICLE_DEBRIS;
-				pp->owner_id = particle->owner_id;
-				pp->owner_index = (u16)particle->owner_index;
-				pp->owner_part_index = particle->owner_part_index;
-				p->length = 1;
-				p->width = (u16)random_int(8, 16);
-				p->height = p->width;
-				p->mass = p->width * p->height;
-
-				f32 r = random_f32();
-				if (r < 0.2f)
-					p->color = 0;
-				else if (r < 0.4f)
-					p->color = 7;
-				else
-					p->color = 2;
-
-				p->angle = random_f32();
-				p->p = particle->part.p;
-				p->v = v2((random_f32() - 0.5f) , (random_f32() - 0.5f));
-				p->passthrough = true;
-				p->die_at_screen_edge = true;
-				p->immune_to_wall = false;
+		/* NOTE(omid): The velocity the collisions saw is clamped once
+		 * more before it's kept. That is not a no-op, a vector scaled to
+		 * 20 can come out a rounding error longer. */
+		struct v2 v = clamp_particle_speed(v2(particles->v_x[i], particles->v_y[i]));
+		particles->v_x[i] = v.x;
+		particles->v_y[i] = v.y;
+
+		f32 x = particles->p_x[i];
+		f32 y = particles->p_y[i];
+
+		if (flags & PARTICLE_FLAG_DIE_AT_SCREEN_EDGE) {
+			if (isnan(x) || isnan(y) || x < 0 || x > WINDOW_WIDTH || y < 0 || y > WINDOW_HEIGHT) {
+				particles->flags[i] = flags | PARTICLE_FLAG_DISPOSED;
+				particles->p_x[i] = WINDOW_WIDTH * 2;
+				particles->p_y[i] = WINDOW_HEIGHT * 2;
 			}
+			continue;
 		}
 
-		struct entity_part_owner owner = { .entity_id = particle->owner_id, .entity_part_index = particle->owner_part_index, .particle_index = particle_index };
-		u32 index;
-		if (find_entity_by_id(game, particle->owner_id, &index))
-			owner.entity_index = (u16)index;
-		update_newtonian_physics_for_part(game, &particle->part, owner);
+		if (isnan(x))
+			x = 0;
+		if (isnan(y))
+			y = 0;
+
+		if (x < 0 || x > WINDOW_WIDTH) {
+			x = x < 0 ? 0 : WINDOW_WIDTH;
+			particles->v_x[i] = -particles->v_x[i] * 0.4f;
+			particles->a_x[i] = 0;
+		}
 
-		if ((particle->type & PARTICLE_FIREBALL) && particle->part.disposed) {
-			spawn_explosion(game, owner, 2, particle->part.p, 200);
+		if (y < 0 || y > WINDOW_HEIGHT) {
+			y = y < 0 ? 0 : WINDOW_HEIGHT;
+			particles->v_y[i] = -particles->v_y[i] * 0.4f;
+			particles->a_y[i] = 0;
 		}
+
+		particles->p_x[i] = x;
+		particles->p_y[i] = y;
 	}
 }
 
 static void
-process_triggered_events(struct game_state *game)
+mark_particles_in_tunnel_wall_scalar(struct particle_store *particles, const struct tunnel_profile *profile, u32 begin, u32 end)
 {
-	if (game->shield_active) {
-		game->shield_energy -= 0.05f;
-		if (game->shield_energy < 0)
-			game->shield_energy = 0;
-	} else {
-		game->shield_energy += 0.01f;
-		if (game->shield_energy > 1)
-			game->shield_energy = 1;
+	for (u32 i = begin; i < end; ++i) {
+		u32 row = tunnel_profile_row(particles->p_y[i]);
+		u16 width = particles->width[i];
+		f32 left = particles->p_x[i] - width / 2;
+		f32 right = particles->p_x[i] + width / 2;
+
+		u32 flags = particles->flags[i] & ~(u32)PARTICLE_FLAG_IN_WALL;
+		if (left < profile->min_x[row] || right > profile->max_x[row])
+			flags |= PARTICLE_FLAG_IN_WALL;
+		particles->flags[i] = flags;
 	}
+}
+
+#if defined(__SSE2__)
+static __m128
+select_ps_sse2(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static __m128
+particle_flag_mask_sse2(const u32 *flags, u32 flag)
+{
+	__m128i wide_flag = _mm_set1_epi32((s32)flag);
+	__m128i f = _mm_and_si128(_mm_loadu_si128((const __m128i *)(const void *)flags), wide_flag);
+	return _mm_castsi128_ps(_mm_cmpeq_epi32(f, wide_flag));
+}
+
+static void
+expire_particles_sse2(struct particle_store *particles, u32 begin, u32 end, f32 time)
+{
+	u32 wide_end = begin + ((end - begin) & ~3u);
+	__m128 wide_time = _mm_set1_ps(time);
+	__m128i disposed = _mm_set1_epi32(PARTICLE_FLAG_DISPOSED);
+	__m128i moving = _mm_set1_epi32(PARTICLE_FLAG_MOVING);
+
+	for (u32 i = begin; i < wide_end; i += 4) {
+		__m128i *flags = (__m128i *)(void *)(particles->flags + i);
+		__m128i expired = _mm_castps_si128(_mm_cmpgt_ps(wide_time, _mm_loadu_ps(particles->expiration_t + i)));
+		__m128i f = _mm_or_si128(_mm_andnot_si128(moving, _mm_loadu_si128(flags)), _mm_and_si128(expired, disposed));
+		__m128i live = _mm_cmpeq_epi32(_mm_and_si128(f, disposed), _mm_setzero_si128());
+		_mm_storeu_si128(flags, _mm_or_si128(f, _mm_and_si128(live, moving)));
+	}
+
+	expire_particles_scalar(particles, wide_end, end, time);
+}
+
+static void
+clamp_particle_speed_sse2(__m128 *v_x, __m128 *v_y)
+{
+	/* NOTE(omid): Same operations as len_v2/normalize_v2/scale_v2, so the
+	 * results match the scalar path bit for bit. */
+	__m128 limit = _mm_set1_ps(20);
+	__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(*v_x, *v_x), _mm_mul_ps(*v_y, *v_y)));
+	__m128 too_fast = _mm_cmpgt_ps(len, limit);
+	*v_x = select_ps_sse2(too_fast, _mm_mul_ps(_mm_div_ps(*v_x, len), limit), *v_x);
+	*v_y = select_ps_sse2(too_fast, _mm_mul_ps(_mm_div_ps(*v_y, len), limit), *v_y);
+}
+
+static void
+integrate_particles_sse2(struct particle_store *particles, u32 begin, u32 end)
+{
+	u32 wide_end = begin + ((end - begin) & ~3u);
+
+	for (u32 i = begin; i < wide_end; i += 4) {
+		__m128 moving = particle_flag_mask_sse2(particles->flags + i, PARTICLE_FLAG_MOVING);
+		__m128 p_x = _mm_loadu_ps(particles->p_x + i);
+		__m128 p_y = _mm_loadu_ps(particles->p_y + i);
+		__m128 old_v_x = _mm_loadu_ps(particles->v_x + i);
+		__m128 old_v_y = _mm_loadu_ps(particles->v_y + i);
+		__m128 v_x = _mm_add_ps(old_v_x, _mm_loadu_ps(particles->a_x + i));
+		__m128 v_y = _mm_add_ps(old_v_y, _mm_loadu_ps(particles->a_y + i));
+
+		clamp_particle_speed_sse2(&v_x, &v_y);
+		_mm_storeu_ps(particles->next_p_x + i, _mm_add_ps(p_x, v_x));
+		_mm_storeu_ps(particles->next_p_y + i, _mm_add_ps(p_y, v_y));
+		_mm_storeu_ps(particles->v_x + i, select_ps_sse2(moving, v_x, old_v_x));
+		_mm_storeu_ps(particles->v_y + i, select_ps_sse2(moving, v_y, old_v_y));
+	}
+
+	integrate_particles_scalar(particles, wide_end, end);
+}
+
+static void
+bound_particles_sse2(struct particle_store *particles, u32 begin, u32 end)
+{
+	u32 wide_end = begin + ((end - begin) & ~3u);
+	__m128 zero = _mm_setzero_ps();
+	__m128 width = _mm_set1_ps(WINDOW_WIDTH);
+	__m128 height = _mm_set1_ps(WINDOW_HEIGHT);
+	__m128 bounce = _mm_set1_ps(0.4f);
+	__m128 sign = _mm_set1_ps(-0.0f);
+	__m128i disposed = _mm_set1_epi32(PARTICLE_FLAG_DISPOSED);
+
+	for (u32 i = begin; i < wide_end; i += 4) {
+		__m128 moving = particle_flag_mask_sse2(particles->flags + i, PARTICLE_FLAG_MOVING);
+		__m128 dies = _mm_and_ps(moving, particle_flag_mask_sse2(particles->flags + i, PARTICLE_FLAG_DIE_AT_SCREEN_EDGE));
+		__m128 stays = _mm_andnot_ps(dies, moving);
+
+		__m128 x = _mm_loadu_ps(particles->p_x + i);
+		__m128 y = _mm_loadu_ps(particles->p_y + i);
+		__m128 old_v_x = _mm_loadu_ps(particles->v_x + i);
+		__m128 old_v_y = _mm_loadu_ps(particles->v_y + i);
+		__m128 a_x = _mm_loadu_ps(particles->a_x + i);
+		__m128 a_y = _mm_loadu_ps(particles->a_y + i);
+
+		__m128 v_x = old_v_x;
+		__m128 v_y = old_v_y;
+		clamp_particle_speed_sse2(&v_x, &v_y);
+		v_x = select_ps_sse2(moving, v_x, old_v_x);
+		v_y = select_ps_sse2(moving, v_y, old_v_y);
+
+		/* NOTE(omid): Particles that die at the screen edge. */
+		__m128 outside = _mm_or_ps(_mm_or_ps(_mm_cmpunord_ps(x, x), _mm_cmpunord_ps(y, y)),
+					   _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(x, zero), _mm_cmpgt_ps(x, width)),
+						     _mm_or_ps(_mm_cmplt_ps(y, zero), _mm_cmpgt_ps(y, height))));
+		__m128 killed = _mm_and_ps(dies, outside);
+
+		__m128i *flags = (__m128i *)(void *)(particles->flags + i);
+		_mm_storeu_si128(flags, _mm_or_si128(_mm_loadu_si128(flags), _mm_and_si128(_mm_castps_si128(killed), disposed)));
+
+		/* NOTE(omid): Everything else is pushed back in and bounces. */
+		__m128 clean_x = _mm_andnot_ps(_mm_cmpunord_ps(x, x), x);
+		__m128 clean_y = _mm_andnot_ps(_mm_cmpunord_ps(y, y), y);
+		__m128 below_x = _mm_cmplt_ps(clean_x, zero);
+		__m128 above_x = _mm_cmpgt_ps(clean_x, width);
+		__m128 below_y = _mm_cmplt_ps(clean_y, zero);
+		__m128 above_y = _mm_cmpgt_ps(clean_y, height);
+		__m128 hit_x = _mm_and_ps(stays, _mm_or_ps(below_x, above_x));
+		__m128 hit_y = _mm_and_ps(stays, _mm_or_ps(below_y, above_y));
+
+		clean_x = select_ps_sse2(below_x, zero, select_ps_sse2(above_x, width, clean_x));
+		clean_y = select_ps_sse2(below_y, zero, select_ps_sse2(above_y, height, clean_y));
+
+		x = select_ps_sse2(killed, _mm_set1_ps(WINDOW_WIDTH * 2), select_ps_sse2(stays, clean_x, x));
+		y = select_ps_sse2(killed, _mm_set1_ps(WINDOW_HEIGHT * 2), select_ps_sse2(stays, clean_y, y));
+		v_x = select_ps_sse2(hit_x, _mm_mul_ps(_mm_xor_ps(v_x, sign), bounce), v_x);
+		v_y = select_ps_sse2(hit_y, _mm_mul_ps(_mm_xor_ps(v_y, sign), bounce), v_y);
+		a_x = _mm_andnot_ps(hit_x, a_x);
+		a_y = _mm_andnot_ps(hit_y, a_y);
+
+		_mm_storeu_ps(particles->p_x + i, x);
+		_mm_storeu_ps(particles->p_y + i, y);
+		_mm_storeu_ps(particles->v_x + i, v_x);
+		_mm_storeu_ps(particles->v_y + i, v_y);
+		_mm_storeu_ps(particles->a_x + i, a_x);
+		_mm_storeu_ps(particles->a_y + i, a_y);
+	}
+
+	bound_particles_scalar(particles, wide_end, end);
+}
+
+static void
+mark_particles_in_tunnel_wall_sse2(struct particle_store *particles, const struct tunnel_profile *profile, u32 begin, u32 end)
+{
+	u32 wide_end = begin + ((end - begin) & ~3u);
+	__m128 thickness = _mm_set1_ps(TUNNEL_SEGMENT_THICKNESS);
+	__m128 last_row = _mm_set1_ps(TUNNEL_PROFILE_ROW_COUNT - 1);
+	__m128i in_wall = _mm_set1_epi32(PARTICLE_FLAG_IN_WALL);
+
+	for (u32 i = begin; i < wide_end; i += 4) {
+		/* NOTE(omid): max_ps returns its second operand for NaN, so a
+		 * NaN y lands on row 0 like in tunnel_profile_row. */
+		__m128 row_f = _mm_div_ps(_mm_loadu_ps(particles->p_y + i), thickness);
+		row_f = _mm_min_ps(_mm_max_ps(row_f, _mm_setzero_ps()), last_row);
+		s32 rows[4];
+		_mm_storeu_si128((__m128i *)(void *)rows, _mm_cvttps_epi32(row_f));
+
+		/* NOTE(omid): No gather in SSE2, the rows are looked up one by
+		 * one and the tests run four wide. */
+		__m128 min_x = _mm_set_ps(profile->min_x[rows[3]], profile->min_x[rows[2]], profile->min_x[rows[1]], profile->min_x[rows[0]]);
+		__m128 max_x = _mm_set_ps(profile->max_x[rows[3]], profile->max_x[rows[2]], profile->max_x[rows[1]], profile->max_x[rows[0]]);
+
+		__m128i width = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(const void *)(particles->width + i)), _mm_setzero_si128());
+		__m128 half_width = _mm_cvtepi32_ps(_mm_srli_epi32(width, 1));
+		__m128 x = _mm_loadu_ps(particles->p_x + i);
+		__m128 hit = _mm_or_ps(_mm_cmplt_ps(_mm_sub_ps(x, half_width), min_x),
+				       _mm_cmpgt_ps(_mm_add_ps(x, half_width), max_x));
+
+		__m128i *flags = (__m128i *)(void *)(particles->flags + i);
+		__m128i f = _mm_andnot_si128(in_wall, _mm_loadu_si128(flags));
+		_mm_storeu_si128(flags, _mm_or_si128(f, _mm_and_si128(_mm_castps_si128(hit), in_wall)));
+	}
+
+	mark_particles_in_tunnel_wall_scalar(particles, profile, wide_end, end);
+}
+
+#define expire_particles expire_particles_sse2
+#define integrate_particles integrate_particles_sse2
+#define bound_particles bound_particles_sse2
+#define mark_particles_in_tunnel_wall mark_particles_in_tunnel_wall_sse2
+#else
+#define expire_particles expire_particles_scalar
+#define integrate_particles integrate_particles_scalar
+#define bound_particles bound_particles_scalar
+#define mark_particles_in_tunnel_wall mark_particles_in_tunnel_wall_scalar
+#endif
+
+static struct entity_part_owner
+particle_part_owner(const struct particle_store *particles, u32 particle_index)
+{
+	const struct particle *particle = particles->info + particle_index;
+	struct entity_part_owner owner = { .entity = particle->owner, .entity_part_index = particle->owner_part_index, .particle_index = (u16)particle_index };
+	return owner;
+}
+
+/* NOTE(omid): Reads the particle and the entities only, contacts go to
+ * 'hits'. Without 'hits' (the serial fallback) they are applied right
+ * away and the outcome is stored as resolve_particle_hit would. */
+static void
+collide_particle(struct game_state *game, u32 particle_index, struct particle_hits *hits)
+{
+	struct particle_store *particles = &game->particles;
+	struct entity_part_owner owner = particle_part_owner(particles, particle_index);
+
+	struct entity_part part;
+	load_particle_part(particles, particle_index, &part);
+
+	struct v2 new_p = v2(particles->next_p_x[particle_index], particles->next_p_y[particle_index]);
+	check_for_collisions_against_entities(game, &part, owner, &new_p, part.v, hits);
+
+	if (!hits) {
+		particles->next_p_x[particle_index] = new_p.x;
+		particles->next_p_y[particle_index] = new_p.y;
+		if (part.disposed)
+			particles->flags[particle_index] |= PARTICLE_FLAG_DISPOSED;
+	}
+}
+
+static void
+detect_particle_hits_range(void *data, u32 worker_index, u32 begin, u32 end)
+{
+	struct game_state *game = data;
+	struct particle_store *particles = &game->particles;
+	struct particle_hits *hits = game->particle_hits + worker_index;
+
+	for (u32 particle_index = begin; particle_index < end; ++particle_index)
+		if (particles->flags[particle_index] & PARTICLE_FLAG_MOVING)
+			collide_particle(game, particle_index, hits);
+}
+
+static s32
+compare_particle_hits(const void *x, const void *y)
+{
+	const struct particle_hit *a = x;
+	const struct particle_hit *b = y;
+	if (a->particle_index != b->particle_index)
+		return a->particle_index < b->particle_index ? -1 : 1;
+	return a->order < b->order ? -1 : a->order > b->order;
+}
+
+static void
+resolve_particle_hit(struct game_state *game, const struct particle_hit *hit)
+{
+	struct particle_store *particles = &game->particles;
+	u32 particle_index = hit->particle_index;
+
+	if (hit->flags & PARTICLE_HIT_DAMAGE) {
+		push_damage_command(game, particle_part_owner(particles, particle_index), hit->target_index, hit->target_part_index,
+				    particles->info[particle_index].dmg, particles->type[particle_index]);
+		particles->flags[particle_index] |= PARTICLE_FLAG_DISPOSED;
+	}
+
+	if (hit->flags & PARTICLE_HIT_PUSH) {
+		struct entity_part *other_part = game->entities[hit->target_index].parts + hit->target_part_index;
+		other_part->force = add_v2(other_part->force, hit->force);
+	}
+
+	particles->next_p_x[particle_index] = hit->p.x;
+	particles->next_p_y[particle_index] = hit->p.y;
+}
+
+static void
+collide_particles(struct game_state *game)
+{
+	struct particle_store *particles = &game->particles;
+	u32 count = particles->count;
+
+	for (u32 i = 0; i < MAX_JOB_WORKER_COUNT; ++i) {
+		game->particle_hits[i].count = 0;
+		game->particle_hits[i].overflowed = false;
+	}
+
+	parallel_for(&job_system, count, PARTICLE_JOB_CHUNK_SIZE, detect_particle_hits_range, game);
+
+	/* NOTE(omid): Detection wrote nothing, so a worker that ran out of
+	 * room is handled by redoing the whole pass serially. */
+	for (u32 i = 0; i < MAX_JOB_WORKER_COUNT; ++i) {
+		if (game->particle_hits[i].overflowed) {
+			for (u32 particle_index = 0; particle_index < count; ++particle_index)
+				if (particles->flags[particle_index] & PARTICLE_FLAG_MOVING)
+					collide_particle(game, particle_index, 0);
+			return;
+		}
+	}
+
+	/* NOTE(omid): All of a particle's contacts come from the worker that
+	 * ran its chunk, so merging the sorted buffers by particle index
+	 * gives the serial order: forces sum in the same order and commands
+	 * are pushed in the same order. */
+	u32 cursors[MAX_JOB_WORKER_COUNT] = { 0 };
+	for (u32 i = 0; i < MAX_JOB_WORKER_COUNT; ++i) {
+		struct particle_hits *hits = game->particle_hits + i;
+		qsort(hits->hits, hits->count, sizeof(struct particle_hit), compare_particle_hits);
+	}
+
+	for (;;) {
+		const struct particle_hit *next = 0;
+		u32 next_worker = 0;
+		for (u32 i = 0; i < MAX_JOB_WORKER_COUNT; ++i) {
+			const struct particle_hits *hits = game->particle_hits + i;
+			if (cursors[i] < hits->count && (!next || hits->hits[cursors[i]].particle_index < next->particle_index)) {
+				next = hits->hits + cursors[i];
+				next_worker = i;
+			}
+		}
+		if (!next)
+			break;
+
+		resolve_particle_hit(game, next);
+		++cursors[next_worker];
+	}
+}
+
+static void
+apply_damage_command(struct game_state *game, const struct damage_command *command, struct random_series *series)
+{
+	struct entity *other = game->entities + command->target_index;
+	struct entity_part *other_part = other->parts + command->target_part_index;
+	u16 dmg = command->dmg;
+
+	/* NOTE(omid): Killed by an earlier hit this frame, the bullet is
+	 * spent on it anyway. */
+	if (other_part->disposed)
+		return;
+
+	if (same_entity(other->handle, game->player) && game->shield_active && game->shield_energy > 0) {
+		spawn_debris(game, series, command->owner, 9, other_part->p, max_u(dmg, 10), false);
+	} else {
+		if (other_part->hp > dmg)
+			other_part->hp -= dmg;
+		else
+			other_part->disposed = true;
+		other_part->hurt = 1;
+
+		if (!same_entity(other->handle, game->player))
+			game->score += dmg * 10;
+
+		if (!other_part->disposed)
+			spawn_debris(game, series, command->owner, other_part->color, other_part->p, max_u(dmg, 10), false);
+		else
+			game->score += other_part->max_hp * 100;
+	}
+
+	if ((command->particle_type & PARTICLE_LIGHTNING_GUIDE)) {
+		struct entity *lightning = game->entity_count < MAX_ENTITY_COUNT ? push_entity(game) : 0;
+		if (lightning && !init_lightning(game, lightning, command->owner.entity, command->owner.entity_part_index, other->handle, command->target_part_index, game->time + 0.5f)) {
+			pop_entity(game, lightning);
+			lightning = 0;
+		}
+		if (!lightning)
+			++game->commands.dropped_spawn_count;
+	}
+}
+
+/* NOTE(omid): Counter based; the stream of the n-th command applied in a
+ * frame depends only on the game seed, the frame and n. */
+static struct random_series
+emitter_random_series(const struct game_state *game, u32 emitter_index)
+{
+	return random_series_for_stream(game->seed ^ mix_random_seed(game->frame_index), emitter_index);
+}
+
+static void
+apply_sim_commands(struct game_state *game)
+{
+	struct sim_commands *commands = &game->commands;
+
+	for (u32 i = 0; i < commands->damage_count; ++i) {
+		struct random_series series = emitter_random_series(game, i);
+		apply_damage_command(game, commands->damages + i, &series);
+	}
+
+	for (u32 i = 0; i < commands->spawn_count; ++i) {
+		const struct spawn_command *command = commands->spawns + i;
+		struct random_series series = emitter_random_series(game, commands->damage_count + i);
+		switch (command->type) {
+		case SPAWN_COMMAND_EXPLOSION:
+			spawn_explosion(game, &series, command->owner, command->color, command->p, command->count);
+			break;
+
+		case SPAWN_COMMAND_TRAIL:
+			spawn_fireball_trail(game, &series, command->p, command->count);
+			break;
+		}
+	}
+
+	commands->damage_count = 0;
+	commands->spawn_count = 0;
+}
+
+static void
+move_particles_range(void *data, u32 worker_index, u32 begin, u32 end)
+{
+	struct game_state *game = data;
+	struct particle_store *particles = &game->particles;
+	(void)worker_index;
+
+	expire_particles(particles, begin, end, game->time);
+	integrate_particles(particles, begin, end);
+	mark_particles_in_tunnel_wall(particles, &game->tunnel_profile, begin, end);
+}
+
+static void
+bound_particles_range(void *data, u32 worker_index, u32 begin, u32 end)
+{
+	struct game_state *game = data;
+	struct particle_store *particles = &game->particles;
+	(void)worker_index;
+
+	for (u32 particle_index = begin; particle_index < end; ++particle_index) {
+		u32 flags = particles->flags[particle_index];
+		if (!(flags & PARTICLE_FLAG_MOVING))
+			continue;
+
+		particles->p_x[particle_index] = particles->next_p_x[particle_index];
+		particles->p_y[particle_index] = particles->next_p_y[particle_index];
+		if ((flags & PARTICLE_FLAG_IN_WALL) && !(flags & PARTICLE_FLAG_IMMUNE_TO_WALL))
+			particles->flags[particle_index] = flags | PARTICLE_FLAG_DISPOSED;
+	}
+
+	bound_particles(particles, begin, end);
+
+	for (u32 particle_index = begin; particle_index < end; ++particle_index) {
+		if (particles->flags[particle_index] & PARTICLE_FLAG_MOVING)
+			force_within_tunnel(game, particles->p_x + particle_index, particles->p_y[particle_index],
+					    particles->v_x + particle_index, particles->a_x + particle_index, particles->width[particle_index]);
+	}
+}
+
+static void
+update_newtonian_physics(struct game_state *game)
+{
+	/* NOTE(omid): Pick up parts added or moved since begin_game_frame. */
+	sync_collision_grid(game);
+
+	for (u16 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		struct entity *entity = game->entities + entity_index;
+		struct entity_part_owner owner = { .entity = entity->handle, .direct = true };
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			owner.entity_part_index = (u16)part_index;
+			struct entity_part *part = entity->parts + part_index;
+			update_newtonian_physics_for_part(game, part, owner);
+			sync_collision_grid_part(&game->collision_grid, entity_index, part_index, part);
+		}
+	}
+
+	/* NOTE(omid): Nothing is pushed into the store while it is being
+	 * updated, spawns and hits are recorded and applied once every
+	 * particle has moved. */
+	struct particle_store *particles = &game->particles;
+	u32 count = particles->count;
+
+	/* NOTE(omid): Chunks are a multiple of 4, so the SSE2 kernels see
+	 * the same lanes as one pass over the whole store. */
+	parallel_for(&job_system, count, PARTICLE_JOB_CHUNK_SIZE, move_particles_range, game);
+
+	/* NOTE(omid): Trails start at the position before this frame's
+	 * move. */
+	for (u32 particle_index = 0; particle_index < count; ++particle_index) {
+		if ((particles->flags[particle_index] & PARTICLE_FLAG_MOVING) && (particles->type[particle_index] & PARTICLE_FIREBALL))
+			push_spawn_command(game, SPAWN_COMMAND_TRAIL, particle_part_owner(particles, particle_index),
+					   v2(particles->p_x[particle_index], particles->p_y[particle_index]), 0, 3);
+	}
+
+	collide_particles(game);
+
+	parallel_for(&job_system, count, PARTICLE_JOB_CHUNK_SIZE, bound_particles_range, game);
+
+	for (u32 particle_index = 0; particle_index < count; ++particle_index) {
+		if (!(particles->flags[particle_index] & PARTICLE_FLAG_MOVING))
+			continue;
+
+		if ((particles->type[particle_index] & PARTICLE_FIREBALL) && (particles->flags[particle_index] & PARTICLE_FLAG_DISPOSED)) {
+			struct entity_part_owner owner = particle_part_owner(particles, particle_index);
+			push_spawn_command(game, SPAWN_COMMAND_EXPLOSION, owner, v2(particles->p_x[particle_index], particles->p_y[particle_index]), 2, 200);
+		}
+	}
+
+	apply_sim_commands(game);
+}
+
+static void
+update_fx_particles(struct game_state *game)
+{
+	u32 count = game->fx_particle_count;
+	for (u32 fx_index = 0; fx_index < count;) {
+		struct fx_particle *fx = game->fx_particles + fx_index;
+		fx->p = add_v2(fx->p, fx->v);
+
+		if (fx->accel > 0) {
+			fx->v = add_v2(fx->v, scale_v2(normalize_v2(fx->v), fx->accel));
+			if (len_v2(fx->v) > 20) {
+				fx->v = scale_v2(normalize_v2(fx->v), 20);
+				fx->accel = 0;
+			}
+		}
+
+		bool dead = !fx->ttl ||
+			fx->p.x < 0 || fx->p.x > WINDOW_WIDTH ||
+			fx->p.y < 0 || fx->p.y > WINDOW_HEIGHT ||
+			hits_tunnel_wall(game, fx->p, fx->size);
+		if (dead) {
+			*fx = game->fx_particles[--count];
+			continue;
+		}
+
+		--fx->ttl;
+		++fx_index;
+	}
+	game->fx_particle_count = count;
+}
+
+static void
+process_triggered_events(struct game_state *game)
+{
+	if (game->shield_active) {
+		game->shield_energy -= 0.05f;
+		if (game->shield_energy < 0)
+			game->shield_energy = 0;
+	} else {
+		game->shield_energy += 0.01f;
+		if (game->shield_energy > 1)
+			game->shield_energy = 1;
+	}
+
+	for (u32 event_index = 0; event_index < game->event_count; ++event_index) {
+		struct game_event *e = game->events + event_index;
+		switch (e->type) {
+		case GAME_EVENT_NONE:
+			break;
 
-	for (u32 event_index = 0; event_index < game->event_count; ++event_index) {
-		struct game_event *e = game->events + event_index;
-		switch (e->type) {
-		case GAME_EVENT_NONE:
-			break;
-
 		case GAME_EVENT_SEED_TOUCH_WATER: {
 			struct entity *seed = game->entities + e->seed_touch_water.e1;
 			struct entity *water = game->entities + e->seed_touch_water.e2;
@@ -2800,99 +5073,102 @@ process_triggered_events(struct game_state *game)
 	}
 }
 
+static void
+push_sound_echo(struct game_state *game, const struct sound *sound, f32 t)
+{
+	struct sound *echo = push_sound(game, sound->type, sound->wave.freq, sound->wave.amp * 0.5f);
+	if (echo) {
+		echo->echo = echo->wave.amp > 0.1f;
+		echo->fadeout = true;
+		echo->fadeout_end = t + 0.1f;
+	}
+}
+
 static void
 stop_track(struct game_state *game, u16 index)
 {
-	if (index > game->track_count)
+	if (index >= game->track_count)
 		return;
 
-	SDL_LockAudioDevice(1);
 	for (u32 i = 0; i < game->sound_count; ++i) {
 		if (game->sounds[i].tag == index && game->sounds[i].wave.tag)
 			game->sounds[i].disposed = true;
 	}
-	SDL_UnlockAudioDevice(1);
 }
 
 static void
 play_track(struct game_state *game, u16 index)
 {
-	if (index > game->track_count)
+	if (index >= game->track_count)
 		return;
 
-	struct track *track = game->tracks + index;
-
-	SDL_LockAudioDevice(1);
-
-	f32 t = (f32)game->played_audio_sample_count / AUDIO_FREQ;
-
 	if (game->last_played_track != index) {
 		stop_track(game, (u16)game->last_played_track);
-		track->current_event = 0;
-		track->last_event_status = 0;
-		track->last_event_time = t;
+
+		struct track *track = game->tracks + index;
+		track->current_note = 0;
+		track->loop_start_sample = game->played_audio_sample_count;
 	}
 	game->last_played_track = index;
+}
 
-	f32 volume = 0.5f;
-
-	struct track_event e = track->events[track->current_event];
-	/* f32 t = game->real_time; */
-	/* f32 next_t = track->last_event_time + (f32)e.t / 1000.0f; */
+static u64
+sequence_track(struct game_state *game, u64 sample_index)
+{
+	/* NOTE(omid): Applies every note of the current track that is due at
+	 * or before sample_index and returns the sample the next note is due. */
+	u16 index = (u16)game->last_played_track;
+	if (index >= game->track_count)
+		return UINT64_MAX;
 
-	f32 next_frame_t = track->last_event_time + (f32)e.t / track->tempo_inverse_scale; /* 1200.0f; */
+	struct track *track = game->tracks + index;
+	if (!track->note_count || !track->loop_sample_count)
+		return UINT64_MAX;
 
-	/* u32 frame = game->frame_index; */
-	/* u32 next_frame = track->last_event_frame + e.t / 15; */
-	/* if (frame >= next_frame || (next_frame - frame) < 1) { */
-	if (t >= next_frame_t) {
-		if (e.a < 0x80) {
-			if (track->last_event_status <= 0x8f) {
-				struct sound *s = find_sound_by_tag(game, index, e.a);
-				if (s)
-					s->disposed = true;
-			} else if (track->last_event_status <= 0x9f) {
-				struct sound *s = push_tagged_sound(game, SAW, (u16)(440 * pow(2, ((f64)e.a - 69.0) / 12.0)), e.b / 127.0f * volume, index, e.a);
-				if (s)
-					s->echo = true;
-
-				/* struct waveform *wave = game->saw_waves + (game->saw_wave_count++); */
-				/* wave->expiration_t = 0; */
-				/* wave->tag = e.a; */
-				/* wave->freq = (u16)(440 * pow(2, ((f64)e.a - 69.0) / 12.0)); */
-				/* wave->amp = e.b / 127.0f; */
+	f32 volume = 0.5f;
+	f32 t = (f32)sample_index / AUDIO_FREQ;
+
+	for (;;) {
+		struct track_note note = track->notes[track->current_note];
+		u64 due = track->loop_start_sample + note.sample_offset;
+		if (due > sample_index)
+			return due;
+
+		if (note.type == TRACK_NOTE_OFF) {
+			struct sound *s = find_sound_by_tag(game, index, note.note);
+			if (s) {
+				/* NOTE(omid): Silence it from this sample on; the echo
+				 * takes over here rather than at the next callback. */
+				s->disposed = true;
+				s->silenced = true;
+				if (s->echo) {
+					s->echo = false;
+					push_sound_echo(game, s, t);
+				}
 			}
 		} else {
-			if (e.a < 0x8f) {
-				struct sound *s = find_sound_by_tag(game, index, e.b);
-				if (s)
-					s->disposed = true;
-
-					/* s->fadeout = true; */
-					/* s->fadeout_begin = t; */
-					/* s->fadeout_end = t + 0.01f; */
+			struct sound *s = push_tagged_sound(game, SAW, game->note_freq[note.note], note.velocity / 127.0f * volume, index, note.note);
+			if (s) {
+				s->echo = true;
+				start_sound_phase(s, sample_index);
+			}
 
-			} else if (e.a < 0x9f) {
-				struct sound *s = push_tagged_sound(game, SAW, (u16)(440 * pow(2, ((f64)e.b - 69.0) / 12.0)), e.c / 127.0f * volume, index, e.b);
-				if (s)
-					s->echo = true;
+			if (note.type == TRACK_NOTE_ON_ACCENT) {
 				struct sound *noise = push_sound(game, WHITENOISE, 0, 0.5f);
-				noise->fadeout = true;
-				noise->fadeout_begin = noise->fadeout_end = t;
+				if (noise) {
+					noise->fadeout = true;
+					noise->fadeout_begin = noise->fadeout_end = t;
+				}
 			}
-
-			track->last_event_status = e.a;
 		}
 
-		track->current_event = (track->current_event + 1) % track->event_count;
-		/* track->last_event_frame = next_frame; */
-		track->last_event_time = next_frame_t;
+		if (++track->current_note == track->note_count) {
+			track->current_note = 0;
+			track->loop_start_sample += track->loop_sample_count;
+		}
 	}
-
-	SDL_UnlockAudioDevice(1);
 }
 
-
 static void
 _fft(double complex buf[], double complex out[], int n, int step)
 {
@@ -2918,10 +5194,125 @@ fft(double complex buf[], double complex tmp[],  int n)
 }
 
 static void
-update_audio(struct game_state *game)
+init_fft_tables(struct fft_tables *tables)
 {
+	for (u32 k = 0; k < FFT_SIZE / 2; ++k) {
+		f64 a = 2.0 * 3.14159265358979 * k / FFT_SIZE;
+		tables->cos_table[k] = (f32)cos(a);
+		tables->sin_table[k] = (f32)sin(a);
+	}
+
+	u32 bits = 0;
+	while ((1u << bits) < FFT_SIZE / 2)
+		++bits;
 
-	SDL_LockAudioDevice(1);
+	for (u32 i = 0; i < FFT_SIZE / 2; ++i) {
+		u32 r = 0;
+		for (u32 b = 0; b < bits; ++b)
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		tables->bit_reverse[i] = (u16)r;
+	}
+}
+
+/* NOTE(omid): In-place FFT of FFT_SIZE real samples. The samples are
+ * treated as FFT_SIZE / 2 interleaved complex values, transformed with an
+ * iterative radix-2 FFT and then split into the real spectrum. Output is
+ * packed: data[0] = X[0], data[1] = X[N / 2] (both real), followed by
+ * (re, im) of X[k] for 0 < k < N / 2 at data[2k], data[2k + 1]. */
+static void
+real_fft(const struct fft_tables *tables, f32 *data)
+{
+	const u32 m = FFT_SIZE / 2;
+
+	for (u32 i = 0; i < m; ++i) {
+		u32 j = tables->bit_reverse[i];
+		if (i < j) {
+			f32 re = data[2 * i], im = data[2 * i + 1];
+			data[2 * i] = data[2 * j];
+			data[2 * i + 1] = data[2 * j + 1];
+			data[2 * j] = re;
+			data[2 * j + 1] = im;
+		}
+	}
+
+	for (u32 size = 2; size <= m; size *= 2) {
+		u32 half = size / 2;
+		u32 table_step = 2 * (m / size);
+		for (u32 start = 0; start < m; start += size) {
+			for (u32 j = 0; j < half; ++j) {
+				f32 wr = tables->cos_table[j * table_step];
+				f32 wi = -tables->sin_table[j * table_step];
+				f32 *a = data + 2 * (start + j);
+				f32 *b = data + 2 * (start + j + half);
+				f32 tr = wr * b[0] - wi * b[1];
+				f32 ti = wr * b[1] + wi * b[0];
+				b[0] = a[0] - tr;
+				b[1] = a[1] - ti;
+				a[0] += tr;
+				a[1] += ti;
+			}
+		}
+	}
+
+	f32 z0r = data[0], z0i = data[1];
+	data[0] = z0r + z0i;
+	data[1] = z0r - z0i;
+
+	for (u32 k = 1; k < m / 2; ++k) {
+		f32 *zk = data + 2 * k;
+		f32 *zm = data + 2 * (m - k);
+
+		/* NOTE(omid): Spectra of the even and odd samples,
+		 * even = (Z[k] + conj(Z[m - k])) / 2, odd = (Z[k] - conj(Z[m - k])) / 2i. */
+		f32 even_re = 0.5f * (zk[0] + zm[0]);
+		f32 even_im = 0.5f * (zk[1] - zm[1]);
+		f32 odd_re = 0.5f * (zk[1] + zm[1]);
+		f32 odd_im = -0.5f * (zk[0] - zm[0]);
+
+		f32 wr = tables->cos_table[k];
+		f32 wi = -tables->sin_table[k];
+		f32 tr = wr * odd_re - wi * odd_im;
+		f32 ti = wr * odd_im + wi * odd_re;
+
+		zk[0] = even_re + tr;
+		zk[1] = even_im + ti;
+		zm[0] = even_re - tr;
+		zm[1] = -(even_im - ti);
+	}
+
+	data[m + 1] = -data[m + 1];
+}
+
+static f32
+real_fft_magnitude(const f32 *data, u32 k)
+{
+	if (k == 0)
+		return fabsf(data[0]);
+	if (k == FFT_SIZE / 2)
+		return fabsf(data[1]);
+	return sqrtf(data[2 * k] * data[2 * k] + data[2 * k + 1] * data[2 * k + 1]);
+}
+
+static void
+update_audio_spectrum(struct game_state *game)
+{
+	f32 data[FFT_SIZE];
+	memcpy(data, game->last_audio_mix, sizeof(data));
+	real_fft(&game->fft_tables, data);
+
+	for (u32 i = 0; i < SPECTRUM_BIN_COUNT; ++i) {
+		f32 v = 2 * real_fft_magnitude(data, i) / FFT_SIZE;
+		if (v > 1)
+			v = 1;
+
+		f32 c = game->audio_spectrum[i];
+		game->audio_spectrum[i] = c + (v - c * 0.1f);
+	}
+}
+
+static void
+update_audio(struct game_state *game)
+{
 	if (true) {
 		for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
 			struct entity *entity = game->entities + entity_index;
@@ -2935,90 +5326,53 @@ update_audio(struct game_state *game)
 					if (amp > 0.5f)
 						amp = 0.5f;
 
-					struct sound *s = push_sound(game, WHITENOISE, 0, amp);
-					if (s)
-						s->once = true;
+					queue_sound(game, WHITENOISE, 0, amp);
 				}
 			}
 		}
 	}
-	for (u32 particle_index = 0; particle_index < game->particle_count; ++particle_index) {
-		struct particle *particle = game->particles + particle_index;
-		/* struct entity_part *part = &particle->part; */
-		if (particle->type == PARTICLE_EXPLOSION) {
-			f32 ttl = particle->expiration_t - game->time;
+	const struct particle_store *particles = &game->particles;
+	for (u32 particle_index = 0; particle_index < particles->count; ++particle_index) {
+		u16 type = particles->type[particle_index];
+		if (type == PARTICLE_EXPLOSION) {
+			f32 ttl = particles->expiration_t[particle_index] - game->time;
 			if (ttl > 0) {
-				struct sound *s = push_sound(game, SINE, 70 + (u16)(30 * fmodf(ttl, 1)), ttl * ttl / 2);
-				if (s)
-					s->once = true;
-
-				s = push_sound(game, SAW, 80 + (u16)(30 * fmodf(ttl, 1)), ttl * ttl / 2);
-				if (s)
-					s->once = true;
-
-				s = push_sound(game, WHITENOISE, 0, fmodf(ttl, 1) / 2);
-				if (s)
-					s->once = true;
+				queue_sound(game, SINE, 70 + (u16)(30 * fmodf(ttl, 1)), ttl * ttl / 2);
+				queue_sound(game, SAW, 80 + (u16)(30 * fmodf(ttl, 1)), ttl * ttl / 2);
+				queue_sound(game, WHITENOISE, 0, fmodf(ttl, 1) / 2);
 			}
-		} else if (particle->type & PARTICLE_FIREBALL) {
-			f32 elapsed = game->time - particle->spawn_t;
-			struct sound *s = push_sound(game, SINE, 200 + (u16)(120 * elapsed), 0.5f);
-			if (s)
-				s->once = true;
-
-			s = push_sound(game, WHITENOISE, 0, fmodf(elapsed, 1) / 2);
-			if (s)
-				s->once = true;
-
+		} else if (type & PARTICLE_FIREBALL) {
+			f32 elapsed = game->time - particles->info[particle_index].spawn_t;
+			queue_sound(game, SINE, 200 + (u16)(120 * elapsed), 0.5f);
+			queue_sound(game, WHITENOISE, 0, fmodf(elapsed, 1) / 2);
 		}
 	}
 
-	SDL_UnlockAudioDevice(1);
-
-	if (false) {
-		static const s32 mix_length = ARRAY_COUNT(game->last_audio_mix);
-		double complex buf[ARRAY_COUNT(game->last_audio_mix)];
-		double complex tmp[ARRAY_COUNT(game->last_audio_mix)];
-		for (u32 i = 0; i < mix_length; ++i)
-			buf[i] =  game->last_audio_mix[i];
-
-		fft(buf, tmp, mix_length);
-
-		/* f64 length = (f64)AUDIO_SAMPLE_COUNT / AUDIO_FREQ; */
-		u32 fft_length = AUDIO_SAMPLE_COUNT / 4;
-		for (u32 i = 0; i < fft_length; ++i) {
-			f32 v = 2 * (f32)(cabs(buf[i] / AUDIO_SAMPLE_COUNT));
-			if (v > 1)
-				v = 1;
-			if (v < -1)
-				v = -1;
-
-			/* f32 v = game->last_audio_mix[i]; */
-			f32 c = game->audio_mix_sample[i];
-			game->audio_mix_sample[i] = v;
-			game->audio_mix_sample[i] = c + (v - c * 0.1f);
-		}
-	} else {
-		game->audio_mix_power = 0;
-		for (u32 i = 0; i < AUDIO_SAMPLE_COUNT; ++i) {
-			f32 v = game->last_audio_mix[i];
-			f32 c = game->audio_mix_sample[i];
-			game->audio_mix_power += (game->audio_mix_sample[i] = c + (v - c * 0.1f));
-		}
-		game->audio_mix_power /= AUDIO_SAMPLE_COUNT;
+	game->audio_mix_power = 0;
+	for (u32 i = 0; i < AUDIO_SAMPLE_COUNT; ++i) {
+		f32 v = game->last_audio_mix[i];
+		f32 c = game->audio_mix_sample[i];
+		game->audio_mix_power += (game->audio_mix_sample[i] = c + (v - c * 0.1f));
 	}
+	game->audio_mix_power /= AUDIO_SAMPLE_COUNT;
 }
 
-static s32
-sort_entity_indices_by_z(const void *x, const void *y)
+static void
+sort_entity_indices_by_z(struct game_state *game)
 {
-	struct entity *entities = global_game->entities; /* thunk; */
-	u32 i1 = *(const u32 *)x;
-	u32 i2 = *(const u32 *)y;
-
-	if (entities[i1].z < entities[i2].z)
-		return -1;
-	return 1;
+	/* NOTE(omid): The order is kept across frames and only a few entities
+	 * change z, so a stable insertion sort is close to a single pass. */
+	u32 *order = game->entity_index_by_z;
+	for (u32 i = 1; i < game->entity_count; ++i) {
+		u32 index = order[i];
+		f32 z = game->entities[index].z;
+		u32 j = i;
+		while (j > 0 && game->entities[order[j - 1]].z > z) {
+			order[j] = order[j - 1];
+			--j;
+		}
+		order[j] = index;
+	}
 }
 
 static f32
@@ -3056,30 +5410,55 @@ static void
 update_game(struct game_state *game,
             const struct input_state *input)
 {
+	struct profiler *profiler = &game->profiler;
+
+	begin_profile_block(profiler, PROFILE_BEGIN_GAME_FRAME);
 	begin_game_frame(game);
+	end_profile_block(profiler, PROFILE_BEGIN_GAME_FRAME);
 
 	/* NOTE(omid): Run level scenario and timings. */
+	begin_profile_block(profiler, PROFILE_RUN_LEVEL_SCENARIO_CONTROL);
 	run_level_scenario_control(game);
+	build_tunnel_profile(game);
+	end_profile_block(profiler, PROFILE_RUN_LEVEL_SCENARIO_CONTROL);
 
 	/* NOTE(omid): Apply user input. */
+	begin_profile_block(profiler, PROFILE_APPLY_USER_INPUT);
 	apply_user_input(game, input);
+	end_profile_block(profiler, PROFILE_APPLY_USER_INPUT);
 
 	/* NOTE(omid): Entity AI. */
+	begin_profile_block(profiler, PROFILE_UPDATE_ENTITY_AI);
 	update_entity_ai(game);
+	end_profile_block(profiler, PROFILE_UPDATE_ENTITY_AI);
 
 	/* NOTE(omid): Spring physics. */
+	begin_profile_block(profiler, PROFILE_UPDATE_SPRING_PHYSICS);
 	update_spring_physics(game);
+	end_profile_block(profiler, PROFILE_UPDATE_SPRING_PHYSICS);
 
 	/* NOTE(omid): Newtonian physics. */
+	begin_profile_block(profiler, PROFILE_UPDATE_NEWTONIAN_PHYSICS);
 	update_newtonian_physics(game);
+	end_profile_block(profiler, PROFILE_UPDATE_NEWTONIAN_PHYSICS);
+
+	begin_profile_block(profiler, PROFILE_UPDATE_FX_PARTICLES);
+	update_fx_particles(game);
+	end_profile_block(profiler, PROFILE_UPDATE_FX_PARTICLES);
 
 	/* NOTE(omid): Triggered events. */
+	begin_profile_block(profiler, PROFILE_PROCESS_TRIGGERED_EVENTS);
 	process_triggered_events(game);
+	end_profile_block(profiler, PROFILE_PROCESS_TRIGGERED_EVENTS);
 
 	/* NOTE(omid): Audio generation. */
+	begin_profile_block(profiler, PROFILE_UPDATE_AUDIO);
 	update_audio(game);
+	end_profile_block(profiler, PROFILE_UPDATE_AUDIO);
 
-	qsort(game->entity_index_by_z, game->entity_count, sizeof(u32), sort_entity_indices_by_z);
+	begin_profile_block(profiler, PROFILE_SORT_BY_Z);
+	sort_entity_indices_by_z(game);
+	end_profile_block(profiler, PROFILE_SORT_BY_Z);
 
 }
 
@@ -3087,54 +5466,25 @@ static void
 render_audio_spectrum(struct game_state *game,
 		      SDL_Renderer *renderer)
 {
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-	SDL_RenderClear(renderer);
-
-	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
-
-	/* SDL_LockAudioDevice(1); */
-
-	static const s32 mix_length = ARRAY_COUNT(game->last_audio_mix);
-	double complex buf[ARRAY_COUNT(game->last_audio_mix)];
-	double complex tmp[ARRAY_COUNT(game->last_audio_mix)];
-	for (u32 i = 0; i < mix_length; ++i)
-		buf[i] =  game->last_audio_mix[i];
-
-	fft(buf, tmp, mix_length);
-
-	/* f64 length = (f64)AUDIO_SAMPLE_COUNT / AUDIO_FREQ; */
-	u32 fft_length = AUDIO_SAMPLE_COUNT / 4;
-	for (u32 i = 0; i < fft_length; ++i) {
-		f32 v = 2 * (f32)(cabs(buf[i] / AUDIO_SAMPLE_COUNT));
-		if (v > 1)
-			v = 1;
-		if (v < -1)
-			v = -1;
-
-		/* f32 v = game->last_audio_mix[i]; */
-		f32 c = game->audio_mix_sample[i];
-		game->audio_mix_sample[i] = v;
-		game->audio_mix_sample[i] = c + (v - c * 0.1f);
-	}
+	/* NOTE(omid): Part of the F1 overlay, the FFT only runs while the
+	 * overlay is up and stays out of the sim. */
+	update_audio_spectrum(game);
 
+	u32 fft_length = SPECTRUM_BIN_COUNT;
 	f32 width = (f32)WINDOW_WIDTH / (f32)fft_length;
 	for (s32 i = 0; i < (s32)fft_length; ++i) {
-		f32 v = game->audio_mix_sample[i];
+		f32 v = game->audio_spectrum[i];
 		s32 x = (s32)(width * (f32)i);
-		s32 h = (s32)(v * WINDOW_HEIGHT / 20.0f) + 1;
+		s32 h = (s32)(v * WINDOW_HEIGHT / 40.0f) + 1;
 		s32 w = (s32)(roundf(width)) + 1;
 
 		for (s32 y = 0; y < 10; ++y) {
 			f32 s = (f32)y / 9.0f;
-			struct color c = color((u8)(s * s * s * 0xFF), (u8)(s * s * 0xFF), (u8)(s * 0xFF), 0xFF);
+			struct color c = color((u8)(s * s * s * 0xFF), (u8)(s * s * 0xFF), (u8)(s * 0xFF), 0x80);
 
-			fill_rect(renderer, x, WINDOW_HEIGHT / 2 - y * h, w, h, c);
+			fill_rect(renderer, x, WINDOW_HEIGHT - (y + 1) * h, w, h, c);
 		}
 	}
-
-	/* SDL_UnlockAudioDevice(1); */
-
-	SDL_RenderPresent(renderer);
 }
 
 static void
@@ -3168,17 +5518,7 @@ render_entity_part(struct game_state *game,
 		u8 alpha = 0xFF;
 
 
-		u32 segment_1 = (u32)(part_p.y / TUNNEL_SEGMENT_THICKNESS);
-		u32 segment_2 = segment_1 + 1;
-
-		struct tunnel_segment s1 = game->tunnel_segments[(game->current_tunnel_segment - segment_1) & (TUNNEL_SEGMENT_COUNT - 1)];
-		struct tunnel_segment s2 = game->tunnel_segments[(game->current_tunnel_segment - segment_2) & (TUNNEL_SEGMENT_COUNT - 1)];
-
-		f32 left = part_p.x - part->width / 2;
-		f32 right = part_p.x + part->width / 2;
-		if (left < s1.left || right > (WINDOW_WIDTH - s1.right))
-			c = 3;
-		else if (left < s2.left || right > (WINDOW_WIDTH - s2.right))
+		if (hits_tunnel_wall(game, part_p, part->width))
 			c = 3;
 
 		fill_cell_(renderer, c, alpha, (s32)part_p.x, (s32)part_p.y, (s32)part->width, (s32)part->height);
@@ -3189,30 +5529,607 @@ render_entity_part(struct game_state *game,
 			/* fill_cell_(renderer, 3, (u8)(part->hurt * 0xff), (s32)part_p.x, (s32)part_p.y, (s32)part->width, (s32)part->height); */
 		}
 
-		/* if (part->content) { */
-		/* 	fill_cell_(renderer, part->content, alpha, (s32)part_p.x, (s32)part_p.y, 10, 10); */
-		/* 	draw_cell(renderer, 0, (s32)part_p.x, (s32)part_p.y, 10, 10); */
-		/* } */
+		/* if (part->content) { */
+		/* 	fill_cell_(renderer, part->content, alpha, (s32)part_p.x, (s32)part_p.y, 10, 10); */
+		/* 	draw_cell(renderer, 0, (s32)part_p.x, (s32)part_p.y, 10, 10); */
+		/* } */
+
+		/* if (part->accept) { */
+		/* 	fill_cell_(renderer, part->accept, 200, (s32)part_p.x, (s32)(part_p.y - part->render_size / 2.0f), (s32)part->render_size, 10); */
+		/* } */
+	} else if (z > 0) {
+		u8 max_alpha = (u8)(0xE0);
+		u8 alpha = (u8)(max_alpha * z);
+
+		set_render_scale(renderer, z, z);
+		special_fill_cell_(renderer, c, alpha, (s32)(part_p.x / z), (s32)(part_p.y / z), (s32)(part->width), (s32)(part->height));
+		set_render_scale(renderer, scale, scale);
+	}
+}
+
+static void
+swap_u8s(u8 *array, u32 i, u32 j)
+{
+	u8 tmp = array[i];
+	array[i] = array[j];
+	array[j] = tmp;
+}
+
+static struct color
+profile_phase_color(u32 phase)
+{
+	u32 count = ARRAY_COUNT(LIGHT_COLORS) - 1;
+	if (phase < count)
+		return LIGHT_COLORS[1 + phase];
+	return BASE_COLORS[1 + (phase - count) % count];
+}
+
+static void
+render_profiler(const struct profiler *profiler, SDL_Renderer *renderer, TTF_Font *small_font)
+{
+	/* NOTE(omid): One stacked column per frame, oldest on the left, with
+	 * a white line at the 60 fps budget. */
+	const s32 column_width = 2;
+	const f32 px_per_ms = 12;
+	const f32 budget_ms = 1000.0f / 60.0f;
+
+	s32 graph_width = PROFILE_HISTORY_COUNT * column_width;
+	s32 graph_height = (s32)(budget_ms * px_per_ms * 1.5f);
+	s32 graph_x = WINDOW_WIDTH - graph_width - 10;
+	s32 graph_bottom = WINDOW_HEIGHT - SMALL_FONT_SIZE - 10;
+
+	fill_rect(renderer, graph_x, graph_bottom - graph_height, graph_width, graph_height, color(0, 0, 0, 0xC0));
+
+	f32 average[PROFILE_PHASE_COUNT] = { 0 };
+
+	for (u32 i = 0; i < PROFILE_HISTORY_COUNT; ++i) {
+		const f32 *row = profiler->history[(profiler->history_index + i) % PROFILE_HISTORY_COUNT];
+		s32 x = graph_x + (s32)i * column_width;
+		f32 y = (f32)graph_bottom;
+
+		for (u32 phase = 0; phase < PROFILE_PHASE_COUNT; ++phase) {
+			average[phase] += row[phase] / PROFILE_HISTORY_COUNT;
+
+			f32 h = row[phase] * px_per_ms;
+			if (y - h < (f32)(graph_bottom - graph_height))
+				h = y - (f32)(graph_bottom - graph_height);
+			if (h <= 0)
+				continue;
+
+			y -= h;
+			fill_rect(renderer, x, (s32)y, column_width, (s32)ceilf(h), profile_phase_color(phase));
+		}
+	}
+
+	fill_rect(renderer, graph_x, graph_bottom - (s32)(budget_ms * px_per_ms), graph_width, 1, color(0xFF, 0xFF, 0xFF, 0xFF));
+
+	s32 legend_x = graph_x - 300;
+	s32 y = graph_bottom - (s32)PROFILE_PHASE_COUNT * (SMALL_FONT_SIZE + 2);
+	fill_rect(renderer, legend_x - 5, y - 5, 300, (s32)PROFILE_PHASE_COUNT * (SMALL_FONT_SIZE + 2) + 5, color(0, 0, 0, 0xC0));
+
+	for (u32 phase = 0; phase < PROFILE_PHASE_COUNT; ++phase) {
+		struct color c = profile_phase_color(phase);
+		fill_rect(renderer, legend_x, y + 3, 10, SMALL_FONT_SIZE - 6, c);
+		draw_string_f(renderer, small_font, legend_x + 15, y, TEXT_ALIGN_LEFT, c, "%s %.2f", PROFILE_PHASE_NAMES[phase], (f64)average[phase]);
+		y += SMALL_FONT_SIZE + 2;
+	}
+}
+
+static void
+render_debug_dump(const struct game_state *game, SDL_Renderer *renderer, TTF_Font *small_font)
+{
+	/* NOTE(omid): Entities and parts on the left, the visible tunnel
+	 * segments on the right, both cut off above the profiler graph. */
+	struct color white = color(0xFF, 0xFF, 0xFF, 0xFF);
+	s32 left = WINDOW_WIDTH / 2 + 20;
+	s32 top = 5 + SMALL_FONT_SIZE;
+	s32 bottom = WINDOW_HEIGHT / 2;
+
+	fill_rect(renderer, left - 5, top - 5, WINDOW_WIDTH - left, bottom - top + 5, color(0, 0, 0, 0xC0));
+
+	s32 y = top;
+	for (u32 entity_index = 0; entity_index < game->entity_count && y < bottom; ++entity_index) {
+		const struct entity *entity = game->entities + entity_index;
+		draw_string_f(renderer, small_font, left, y, TEXT_ALIGN_LEFT, white, "E (%u): HAS TARGET? %s [(%.1f, %.1f) * %.2f]", entity_index, entity->has_target ? "YES" : "NO", (f64)entity->target.x, (f64)entity->target.y, (f64)entity->pull_of_target);
+		y += SMALL_FONT_SIZE;
+
+		for (u32 part_index = 0; part_index < entity->part_count && y < bottom; ++part_index) {
+			const struct entity_part *part = entity->parts + (entity->part_count - part_index - 1);
+			draw_string_f(renderer, small_font, left + 20, y, TEXT_ALIGN_LEFT, white, "E (%u, %u): (%.1f, %.1f)", entity_index, part_index, (f64)part->p.x, (f64)part->p.y);
+			y += SMALL_FONT_SIZE;
+		}
+	}
+
+	y = top;
+	u32 visible_count = WINDOW_HEIGHT / TUNNEL_SEGMENT_THICKNESS;
+	for (u32 i = 0; i < visible_count && y < bottom; ++i) {
+		u32 segment_index = (game->current_tunnel_segment - i) & (TUNNEL_SEGMENT_COUNT - 1);
+		struct tunnel_segment segment = game->tunnel_segments[segment_index];
+		draw_string_f(renderer, small_font, WINDOW_WIDTH - 10, y, TEXT_ALIGN_RIGHT, white, "SEGMENT: %u, %u", segment.left, segment.right);
+		y += SMALL_FONT_SIZE;
+	}
+}
+
+#define TUNNEL_CACHE_ROW_COUNT 128
+#define MAX_TUNNEL_EDGE_CELL_COUNT 32
+#define TUNNEL_BAR_COUNT 10
+
+struct tunnel_edge_cell {
+	s16 x;
+	s16 w;
+	struct color light;
+	struct color dark;
+};
+
+struct tunnel_cache_row {
+	bool valid;
+	u32 segment_index;
+	struct tunnel_segment segment;
+	u32 edge_cell_count;
+	struct tunnel_edge_cell edge_cells[MAX_TUNNEL_EDGE_CELL_COUNT];
+};
+
+/* NOTE(omid): The walls only scroll, one segment per frame. Each
+ * segment's row is drawn once into a ring of rows in a target texture,
+ * in reverse segment order so the ring reads top-down in screen order,
+ * and the visible window is copied out in at most two slices. The
+ * top/bottom shading of the narrow cells depends on the screen row, so
+ * it stays out of the texture and is drawn per frame from the cells
+ * recorded with the row. */
+struct tunnel_cache {
+	SDL_Texture *texture;
+	bool texture_failed;
+	struct tunnel_cache_row rows[TUNNEL_CACHE_ROW_COUNT];
+	bool bar_colors_ready;
+	u32 bar_level;
+	struct color bar_colors[TUNNEL_BAR_COUNT];
+};
+
+static struct tunnel_cache tunnel_cache;
+
+static void
+invalidate_tunnel_cache(void)
+{
+	for (u32 i = 0; i < TUNNEL_CACHE_ROW_COUNT; ++i)
+		tunnel_cache.rows[i].valid = false;
+}
+
+static void
+reset_tunnel_cache_texture(void)
+{
+	/* NOTE(omid): After a device reset the target texture is gone along
+	 * with its contents, render_tunnel creates a new one. */
+	if (tunnel_cache.texture)
+		SDL_DestroyTexture(tunnel_cache.texture);
+	tunnel_cache.texture = 0;
+	tunnel_cache.texture_failed = false;
+	invalidate_tunnel_cache();
+}
+
+static u32
+tunnel_cache_slot(u32 segment_index)
+{
+	return ~segment_index & (TUNNEL_CACHE_ROW_COUNT - 1);
+}
+
+static void
+fill_tunnel_wall_cell(SDL_Renderer *renderer, struct tunnel_cache_row *row, u8 alpha, s32 offset_x, s32 offset_y, s32 w, s32 h)
+{
+	/* NOTE(omid): special_fill_cell_ for the walls' base color 0, minus
+	 * the top/bottom shading. */
+	s32 x = (s32)(round(offset_x - (w / 2.0)));
+	s32 y = (s32)(round(offset_y - (h / 2.0)));
+
+	if (w < 40) {
+		struct color base_color = BASE_COLORS[0];
+		struct color light_color = LIGHT_COLORS[0];
+		struct color dark_color = DARK_COLORS[0];
+		base_color.a = alpha;
+		light_color.a = alpha;
+		dark_color.a = alpha;
+
+		fill_rect(renderer, x, y, w, h, base_color);
+		fill_cell_x_edges(renderer, x, y, w, h, offset_x, light_color, dark_color);
+
+		if (row->edge_cell_count < MAX_TUNNEL_EDGE_CELL_COUNT) {
+			struct tunnel_edge_cell *cell = row->edge_cells + (row->edge_cell_count++);
+			cell->x = (s16)x;
+			cell->w = (s16)w;
+			cell->light = light_color;
+			cell->dark = dark_color;
+		}
+	} else {
+		struct color c = w < 120 ? BASE_COLORS[0] : DARK_COLORS[0];
+		c.a = alpha;
+		fill_rect(renderer, x, y, w, h, c);
+	}
+}
+
+static void
+draw_tunnel_wall_row(SDL_Renderer *renderer, struct tunnel_cache_row *row, struct tunnel_segment segment, s32 offset_y)
+{
+	f32 len_o = len_v2(screen_center) + 100;
+
+	row->edge_cell_count = 0;
+
+	f32 r = 0;
+	f32 w = 20;
+	while (r < segment.left) {
+		w = ((f32)segment.left - r) / 4.0f;
+		if (w < 20)
+			w = 20;
+
+		u8 alpha = (u8)(0xE0 * sqrtf(r / len_o));
+		fill_tunnel_wall_cell(renderer, row, alpha, (s32)r, offset_y, (s32)w, TUNNEL_SEGMENT_THICKNESS);
+		r += w;
+	}
+
+	r = 0;
+	while (r < segment.right) {
+		w = (segment.right - r) / 4.0f;
+		if (w < 20)
+			w = 20;
+
+		fill_tunnel_wall_cell(renderer, row, 0xFF, (s32)(WINDOW_WIDTH - r), offset_y, (s32)w, TUNNEL_SEGMENT_THICKNESS);
+		r += w;
+	}
+}
+
+static void
+fill_tunnel_row_y_edges(SDL_Renderer *renderer, const struct tunnel_cache_row *row, s32 offset_y)
+{
+	s32 h = TUNNEL_SEGMENT_THICKNESS;
+	s32 y = (s32)(round(offset_y - (h / 2.0)));
+	for (u32 i = 0; i < row->edge_cell_count; ++i) {
+		const struct tunnel_edge_cell *cell = row->edge_cells + i;
+		fill_cell_y_edges(renderer, cell->x, y, cell->w, h, offset_y, cell->light, cell->dark);
+	}
+}
+
+static void
+render_tunnel(struct game_state *game, SDL_Renderer *renderer, f32 scale)
+{
+	struct tunnel_cache *cache = &tunnel_cache;
+	const s32 thickness = TUNNEL_SEGMENT_THICKNESS;
+	u32 visible_count = WINDOW_HEIGHT / TUNNEL_SEGMENT_THICKNESS;
+
+	if (!cache->texture && !cache->texture_failed) {
+		cache->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, WINDOW_WIDTH, TUNNEL_CACHE_ROW_COUNT * TUNNEL_SEGMENT_THICKNESS);
+		if (cache->texture)
+			SDL_SetTextureBlendMode(cache->texture, SDL_BLENDMODE_NONE);
+		else
+			cache->texture_failed = true;
+		invalidate_tunnel_cache();
+	}
+
+	if (cache->texture) {
+		/* NOTE(omid): Normally only the newest segment is missing. Rows
+		 * are drawn over opaque black, which is what the screen holds
+		 * under the tunnel, so the copy can skip blending. */
+		bool target_bound = false;
+		for (u32 i = 0; i < visible_count; ++i) {
+			u32 segment_index = (game->current_tunnel_segment - i) & (TUNNEL_SEGMENT_COUNT - 1);
+			struct tunnel_segment segment = game->tunnel_segments[segment_index];
+			u32 slot = tunnel_cache_slot(segment_index);
+			struct tunnel_cache_row *row = cache->rows + slot;
+			if (row->valid && row->segment_index == segment_index &&
+			    row->segment.left == segment.left && row->segment.right == segment.right)
+				continue;
+
+			if (!target_bound) {
+				flush_rect_batch(renderer);
+				SDL_SetRenderTarget(renderer, cache->texture);
+				set_render_scale(renderer, 1, 1);
+				target_bound = true;
+			}
+
+			s32 top = (s32)slot * thickness;
+			fill_rect(renderer, 0, top, WINDOW_WIDTH, thickness, color(0, 0, 0, 0xFF));
+			draw_tunnel_wall_row(renderer, row, segment, top + thickness / 2);
+			row->valid = true;
+			row->segment_index = segment_index;
+			row->segment = segment;
+		}
+
+		if (target_bound) {
+			flush_rect_batch(renderer);
+			SDL_SetRenderTarget(renderer, 0);
+			set_render_scale(renderer, scale, scale);
+		}
+
+		u32 first_slot = tunnel_cache_slot(game->current_tunnel_segment);
+		u32 first_count = TUNNEL_CACHE_ROW_COUNT - first_slot;
+		if (first_count > visible_count)
+			first_count = visible_count;
+
+		flush_rect_batch(renderer);
+		SDL_Rect source = { .x = 0, .y = (s32)first_slot * thickness, .w = WINDOW_WIDTH, .h = (s32)first_count * thickness };
+		SDL_Rect dest = { .x = 0, .y = -thickness / 2, .w = WINDOW_WIDTH, .h = source.h };
+		SDL_RenderCopy(renderer, cache->texture, &source, &dest);
+
+		if (first_count < visible_count) {
+			source.y = 0;
+			source.h = (s32)(visible_count - first_count) * thickness;
+			dest.y += dest.h;
+			dest.h = source.h;
+			SDL_RenderCopy(renderer, cache->texture, &source, &dest);
+		}
+	}
+
+	/* NOTE(omid): Gradient for the audio bars, s^2 of the level's accent
+	 * color, rebuilt only when the level changes. */
+	if (!cache->bar_colors_ready || cache->bar_level != game->current_level) {
+		struct color accent = LIGHT_COLORS[(u8)(game->current_level + 1) % ARRAY_COUNT(LIGHT_COLORS)];
+		for (u32 x = 0; x < TUNNEL_BAR_COUNT; ++x) {
+			f32 s = (f32)x / (f32)(TUNNEL_BAR_COUNT - 1);
+			f32 g = s * s;
+			cache->bar_colors[x] = color((u8)(g * accent.r), (u8)(g * accent.g), (u8)(g * accent.b), 0x80);
+		}
+		cache->bar_level = game->current_level;
+		cache->bar_colors_ready = true;
+	}
+
+	for (u32 i = 0; i < visible_count; ++i) {
+		u32 segment_index = (game->current_tunnel_segment - i) & (TUNNEL_SEGMENT_COUNT - 1);
+		struct tunnel_segment segment = game->tunnel_segments[segment_index];
+		s32 y = thickness * (s32)i;
+
+		if (cache->texture) {
+			fill_tunnel_row_y_edges(renderer, cache->rows + tunnel_cache_slot(segment_index), y);
+		} else {
+			struct tunnel_cache_row row;
+			draw_tunnel_wall_row(renderer, &row, segment, y);
+			fill_tunnel_row_y_edges(renderer, &row, y);
+		}
+
+		f32 v = fabsf(game->audio_mix_sample[segment_index % AUDIO_SAMPLE_COUNT]);
+		f32 segment_width = v * 50 / TUNNEL_BAR_COUNT;
+
+		for (s32 x = 0; x < TUNNEL_BAR_COUNT; ++x) {
+			struct color c = cache->bar_colors[x];
+			fill_rect(renderer, (s32)(segment.left + (f32)x * segment_width), y, (s32)(segment_width), thickness, c);
+			fill_rect(renderer, (s32)(WINDOW_WIDTH - segment.right - (f32)(x + 1) * segment_width), y, (s32)(segment_width), thickness, c);
+		}
+	}
+}
+
+/* NOTE(omid): Live particles are gathered into flat arrays first so the
+ * corner rotation can run four particles at a time, then written out as
+ * one untextured quad each. */
+struct particle_quads {
+	u32 count;
+	f32 center_x[MAX_PARTICLE_COUNT];
+	f32 center_y[MAX_PARTICLE_COUNT];
+	f32 half_w[MAX_PARTICLE_COUNT];
+	f32 half_h[MAX_PARTICLE_COUNT];
+	f32 cos_angle[MAX_PARTICLE_COUNT];
+	f32 sin_angle[MAX_PARTICLE_COUNT];
+	SDL_Color colors[MAX_PARTICLE_COUNT];
+	SDL_Vertex vertices[MAX_PARTICLE_COUNT * 4];
+	s32 indices[MAX_PARTICLE_COUNT * 6];
+	bool indices_ready;
+};
+
+static struct particle_quads particle_quads;
+
+static void
+gather_particle_quads(const struct game_state *game, struct particle_quads *quads)
+{
+	u32 count = 0;
+	const struct particle_store *particles = &game->particles;
+	for (u32 particle_index = 0; particle_index < particles->count; ++particle_index) {
+		f32 ttl = particles->expiration_t[particle_index] - game->time;
+		if (ttl < 0)
+			continue;
+
+		const struct particle *particle = particles->info + particle_index;
+		u8 c = (u8)particle->color;
+		if (c == UINT8_MAX)
+			continue;
+
+		struct color color = BASE_COLORS[c];
+		if (ttl < 1)
+			color.a = (u8)(ttl * 0xff);
+
+		/* NOTE(omid): Same pixel snapping as the old per-particle
+		 * RenderCopyEx: integer top-left, rotated about the center. */
+		f32 half_w = (f32)particles->width[particle_index] / 2;
+		f32 half_h = (f32)particles->height[particle_index] / 2;
+		quads->center_x[count] = (f32)(s32)particles->p_x[particle_index] + half_w;
+		quads->center_y[count] = (f32)(s32)particles->p_y[particle_index] + half_h;
+		quads->half_w[count] = half_w;
+		quads->half_h[count] = half_h;
+		quads->cos_angle[count] = cosf(particle->angle);
+		quads->sin_angle[count] = sinf(particle->angle);
+		quads->colors[count] = (SDL_Color){ color.r, color.g, color.b, color.a };
+		++count;
+	}
+	quads->count = count;
+}
+
+static void
+gather_fx_particle_quads(const struct game_state *game, struct particle_quads *quads)
+{
+	u32 count = 0;
+	for (u32 fx_index = 0; fx_index < game->fx_particle_count; ++fx_index) {
+		const struct fx_particle *fx = game->fx_particles + fx_index;
+		if (fx->color == UINT8_MAX)
+			continue;
+
+		struct color color = BASE_COLORS[fx->color];
+		color.a = (u8)(fx->ttl * 0xff / FX_PARTICLE_TTL);
+
+		f32 half = (f32)fx->size / 2;
+		f32 angle = (f32)fx->angle / 255;
+		quads->center_x[count] = (f32)(s32)fx->p.x + half;
+		quads->center_y[count] = (f32)(s32)fx->p.y + half;
+		quads->half_w[count] = half;
+		quads->half_h[count] = half;
+		quads->cos_angle[count] = cosf(angle);
+		quads->sin_angle[count] = sinf(angle);
+		quads->colors[count] = (SDL_Color){ color.r, color.g, color.b, color.a };
+		++count;
+	}
+	quads->count = count;
+}
+
+static void
+build_particle_quad(struct particle_quads *quads, u32 i)
+{
+	f32 cx = quads->center_x[i], cy = quads->center_y[i];
+	f32 a = quads->half_w[i] * quads->cos_angle[i];
+	f32 b = quads->half_h[i] * quads->sin_angle[i];
+	f32 d = quads->half_w[i] * quads->sin_angle[i];
+	f32 e = quads->half_h[i] * quads->cos_angle[i];
+	SDL_Color color = quads->colors[i];
+
+	SDL_Vertex *v = quads->vertices + i * 4;
+	v[0] = (SDL_Vertex){ { cx - a + b, cy - e - d }, color, { 0, 0 } };
+	v[1] = (SDL_Vertex){ { cx + a + b, cy - e + d }, color, { 0, 0 } };
+	v[2] = (SDL_Vertex){ { cx + a - b, cy + e + d }, color, { 0, 0 } };
+	v[3] = (SDL_Vertex){ { cx - a - b, cy + e - d }, color, { 0, 0 } };
+}
+
+static void
+build_particle_quads_scalar(struct particle_quads *quads)
+{
+	for (u32 i = 0; i < quads->count; ++i)
+		build_particle_quad(quads, i);
+}
+
+#if defined(__SSE2__)
+static void
+store_particle_corners_sse2(SDL_Vertex *v, __m128 x, __m128 y)
+{
+	/* NOTE(omid): v points at corner k of the first of four particles;
+	 * the same corner of the next particle is four vertices further. */
+	__m128 lo = _mm_unpacklo_ps(x, y);
+	__m128 hi = _mm_unpackhi_ps(x, y);
+	_mm_storel_pi((__m64 *)(void *)&v[0].position, lo);
+	_mm_storeh_pi((__m64 *)(void *)&v[4].position, lo);
+	_mm_storel_pi((__m64 *)(void *)&v[8].position, hi);
+	_mm_storeh_pi((__m64 *)(void *)&v[12].position, hi);
+}
+
+static void
+build_particle_quads_sse2(struct particle_quads *quads)
+{
+	u32 wide_count = quads->count & ~3u;
+
+	for (u32 i = 0; i < wide_count; i += 4) {
+		__m128 cx = _mm_loadu_ps(quads->center_x + i);
+		__m128 cy = _mm_loadu_ps(quads->center_y + i);
+		__m128 hw = _mm_loadu_ps(quads->half_w + i);
+		__m128 hh = _mm_loadu_ps(quads->half_h + i);
+		__m128 c = _mm_loadu_ps(quads->cos_angle + i);
+		__m128 s = _mm_loadu_ps(quads->sin_angle + i);
+
+		__m128 a = _mm_mul_ps(hw, c);
+		__m128 b = _mm_mul_ps(hh, s);
+		__m128 d = _mm_mul_ps(hw, s);
+		__m128 e = _mm_mul_ps(hh, c);
+
+		__m128 left = _mm_sub_ps(cx, a);
+		__m128 right = _mm_add_ps(cx, a);
+		__m128 top = _mm_sub_ps(cy, e);
+		__m128 bottom = _mm_add_ps(cy, e);
+
+		SDL_Vertex *v = quads->vertices + i * 4;
+		store_particle_corners_sse2(v + 0, _mm_add_ps(left, b), _mm_sub_ps(top, d));
+		store_particle_corners_sse2(v + 1, _mm_add_ps(right, b), _mm_add_ps(top, d));
+		store_particle_corners_sse2(v + 2, _mm_sub_ps(right, b), _mm_add_ps(bottom, d));
+		store_particle_corners_sse2(v + 3, _mm_sub_ps(left, b), _mm_sub_ps(bottom, d));
+
+		for (u32 j = 0; j < 16; ++j) {
+			v[j].color = quads->colors[i + j / 4];
+			v[j].tex_coord = (SDL_FPoint){ 0, 0 };
+		}
+	}
+
+	for (u32 i = wide_count; i < quads->count; ++i)
+		build_particle_quad(quads, i);
+}
+
+#define build_particle_quads build_particle_quads_sse2
+#else
+#define build_particle_quads build_particle_quads_scalar
+#endif
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+static void
+draw_particle_quads(SDL_Renderer *renderer, struct particle_quads *quads)
+{
+	if (!quads->indices_ready) {
+		for (s32 i = 0; i < MAX_PARTICLE_COUNT; ++i) {
+			s32 *index = quads->indices + i * 6;
+			index[0] = i * 4;
+			index[1] = i * 4 + 1;
+			index[2] = i * 4 + 2;
+			index[3] = i * 4;
+			index[4] = i * 4 + 2;
+			index[5] = i * 4 + 3;
+		}
+		quads->indices_ready = true;
+	}
+
+	if (!quads->count)
+		return;
+
+	build_particle_quads(quads);
+	SDL_RenderGeometry(renderer, 0, quads->vertices, (s32)quads->count * 4, quads->indices, (s32)quads->count * 6);
+}
+#endif
 
-		/* if (part->accept) { */
-		/* 	fill_cell_(renderer, part->accept, 200, (s32)part_p.x, (s32)(part_p.y - part->render_size / 2.0f), (s32)part->render_size, 10); */
-		/* } */
-	} else if (z > 0) {
-		u8 max_alpha = (u8)(0xE0);
-		u8 alpha = (u8)(max_alpha * z);
+static void
+render_particles(struct game_state *game, SDL_Renderer *renderer)
+{
+	flush_rect_batch(renderer);
 
-		SDL_RenderSetScale(renderer, z, z);
-		special_fill_cell_(renderer, c, alpha, (s32)(part_p.x / z), (s32)(part_p.y / z), (s32)(part->width), (s32)(part->height));
-		SDL_RenderSetScale(renderer, scale, scale);
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	gather_particle_quads(game, &particle_quads);
+	draw_particle_quads(renderer, &particle_quads);
+#else
+	/* NOTE(omid): No SDL_RenderGeometry before 2.0.18, one rotated copy
+	 * per particle. */
+	const struct particle_store *particles = &game->particles;
+	for (u32 particle_index = 0; particle_index < particles->count; ++particle_index) {
+		f32 ttl = particles->expiration_t[particle_index] - game->time;
+		if (ttl < 0)
+			continue;
+
+		const struct particle *particle = particles->info + particle_index;
+		u8 c = (u8)particle->color;
+		if (c == UINT8_MAX)
+			continue;
+
+		struct color color = BASE_COLORS[c];
+		if (ttl < 1)
+			color.a = (u8)(ttl * 0xff);
+		fill_rotated_rect(game, renderer, (s32)particles->p_x[particle_index], (s32)particles->p_y[particle_index],
+				  (s32)particles->width[particle_index], (s32)particles->height[particle_index], (f64)particle->angle, color);
 	}
+#endif
 }
 
 static void
-swap_u8s(u8 *array, u32 i, u32 j)
+render_fx_particles(struct game_state *game, SDL_Renderer *renderer)
 {
-	u8 tmp = array[i];
-	array[i] = array[j];
-	array[j] = tmp;
+	flush_rect_batch(renderer);
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+	gather_fx_particle_quads(game, &particle_quads);
+	draw_particle_quads(renderer, &particle_quads);
+#else
+	for (u32 fx_index = 0; fx_index < game->fx_particle_count; ++fx_index) {
+		const struct fx_particle *fx = game->fx_particles + fx_index;
+		if (fx->color == UINT8_MAX)
+			continue;
+
+		struct color color = BASE_COLORS[fx->color];
+		color.a = (u8)(fx->ttl * 0xff / FX_PARTICLE_TTL);
+		fill_rotated_rect(game, renderer, (s32)fx->p.x, (s32)fx->p.y, fx->size, fx->size, (f64)fx->angle / 255, color);
+	}
+#endif
 }
 
 static void
@@ -3228,141 +6145,23 @@ render_game(struct game_state *game,
 
 	/* f32 elapsed_t = game->time - game->level_begin_t; */
 
-	struct v2 o = screen_center; /* v2(WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2); */
-	f32 len_o = len_v2(o) + 100;
-
 	f32 scale = 1 + game->audio_mix_power * 0.24f;
 
 	SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
-	SDL_RenderSetScale(renderer, scale, scale);
+	set_render_scale(renderer, scale, scale);
 
-	/* NOTE(omid): Render tunnel. */
-	if (true) {
-		f32 fade_progress = 1.0f;
-		if (game->time < game->level_begin_t) {
-			f32 tunnel_d = game->level_begin_t - game->tunnel_begin_t;
-			fade_progress = (game->time - game->tunnel_begin_t) / tunnel_d;
-		}
-		fade_progress = 1.0f;
-
-		u32 visible_count = WINDOW_HEIGHT / TUNNEL_SEGMENT_THICKNESS;
-
-		for (u32 i = 0; i < visible_count; ++i) {
-			u32 segment_index = (game->current_tunnel_segment - i) & (TUNNEL_SEGMENT_COUNT - 1);
-			struct tunnel_segment segment = game->tunnel_segments[segment_index];
-			u8 base_color = 0;
-			/* struct color dark = DARK_COLORS[(u8)(game->current_level + 1) % ARRAY_COUNT(DARK_COLORS)]; */
-			struct color accent = LIGHT_COLORS[(u8)(game->current_level + 1) % ARRAY_COUNT(LIGHT_COLORS)];
-			u8 pows[3] = { 2, 2, 2 };
-			/* if (accent.r > accent.g && accent.r > accent.b) { */
-			/* 	pows[0] = 1; */
-			/* 	if (accent.g > accent.b) { */
-			/* 		pows[1] = 2; */
-			/* 		pows[2] = 3; */
-			/* 	} else { */
-			/* 		pows[1] = 3; */
-			/* 		pows[2] = 2; */
-			/* 	} */
-			/* } else if (accent.r > accent.g) { */
-			/* 	pows[0] = 2; */
-			/* 	pows[1] = 3; */
-			/* 	pows[2] = 1; */
-			/* } else if (accent.r > accent.b) { */
-			/* 	pows[0] = 2; */
-			/* 	pows[1] = 1; */
-			/* 	pows[2] = 3; */
-			/* } else if (accent.g > accent.b) { */
-			/* 	pows[0] = 3; */
-			/* 	pows[1] = 1; */
-			/* 	pows[2] = 2; */
-			/* } else { */
-			/* 	pows[0] = 3; */
-			/* 	pows[1] = 2; */
-			/* 	pows[2] = 1; */
-			/* } */
-
-			f32 r = 0;
-			f32 w = 20;
-			while (r < segment.left) {
-				w = ((f32)segment.left - r) / 4.0f;
-				if (w < 20)
-					w = 20;
-
-				u8 max_alpha = (u8)(0xE0 * sqrtf(r / len_o));
-				u8 alpha = max_alpha;
-				if (game->time < game->level_begin_t)
-					alpha = (u8)(max_alpha * fade_progress);
-
-				struct v2 sp = v2(r, (f32)TUNNEL_SEGMENT_THICKNESS * (f32)i);
-				struct color color = BASE_COLORS[base_color];
-				color.a = alpha;
-				/* render_rect(renderer, color, (s32)sp.x, (s32)sp.y, (s32)w, TUNNEL_SEGMENT_THICKNESS, false); */
-				special_fill_cell_(renderer, base_color, alpha, (s32)sp.x, (s32)sp.y, (s32)w, TUNNEL_SEGMENT_THICKNESS);
-				r += w;
-			}
-
-			if (true) {
-				f32 v = fabsf(game->audio_mix_sample[segment_index % AUDIO_SAMPLE_COUNT]);
-				s32 y = (s32)(TUNNEL_SEGMENT_THICKNESS * i);
-				s32 h = TUNNEL_SEGMENT_THICKNESS; /* (s32)(v * WINDOW_HEIGHT / 20.0f) + 1; */
-				f32 total_width = v * 50;
-				f32 segment_width = total_width / 10;
-
-				for (s32 x = 0; x < 10; ++x) {
-					f32 s = (f32)x / 9.0f;
-					/* struct color c = color((u8)(s * s * s * accent.r), (u8)(s * s * accent.g), (u8)(s * accent.b), 0xA0); */
-
-					f32 sr = powf(s, pows[0]);
-					f32 sg = powf(s, pows[1]);
-					f32 sb = powf(s, pows[2]);
-					struct color c = color((u8)(sr * accent.r), (u8)(sg * accent.g), (u8)(sb * accent.b), 0x80);
-					fill_rect(renderer, (s32)(segment.left + (f32)x * segment_width), y, (s32)(segment_width), h, c);
-				}
-			}
-
-			r = 0;
-			while (r < segment.right) {
-				w = (segment.right - r) / 4.0f;
-				if (w < 20)
-					w = 20;
-
-
-				u8 max_alpha = (u8)(0xE0 * sqrtf(r / len_o));
-				u8 alpha = max_alpha;
-				if (game->time < game->level_begin_t)
-					alpha = (u8)(max_alpha * fade_progress);
-				alpha = 0xff;
-
-				struct v2 sp = v2(WINDOW_WIDTH - r, (f32)TUNNEL_SEGMENT_THICKNESS * (f32)i);
-				struct color color = BASE_COLORS[base_color];
-				color.a = alpha;
-				special_fill_cell_(renderer, base_color, alpha, (s32)sp.x, (s32)sp.y, (s32)w, TUNNEL_SEGMENT_THICKNESS);
-				r += w;
-			}
+	struct profiler *profiler = &game->profiler;
 
-			if (true) {
-				f32 v = fabsf(game->audio_mix_sample[segment_index % AUDIO_SAMPLE_COUNT]);
-				s32 y = (s32)(TUNNEL_SEGMENT_THICKNESS * i);
-				s32 h = TUNNEL_SEGMENT_THICKNESS; /* (s32)(v * WINDOW_HEIGHT / 20.0f) + 1; */
-				f32 total_width = v * 50;
-				f32 segment_width = total_width / 10;
-
-				for (s32 x = 0; x < 10; ++x) {
-					f32 s = (f32)x / 9.0f;
-					/* struct color c = color((u8)(s * s * s * accent.r), (u8)(s * s * accent.g), (u8)(s * accent.b), 0x80); */
-					f32 sr = powf(s, pows[0]);
-					f32 sg = powf(s, pows[1]);
-					f32 sb = powf(s, pows[2]);
-					struct color c = color((u8)(sr * accent.r), (u8)(sg * accent.g), (u8)(sb * accent.b), 0x80);
-					fill_rect(renderer, (s32)(WINDOW_WIDTH - segment.right - (f32)(x + 1) * segment_width), y, (s32)(segment_width), h, c);
-				}
-			}
-
-		}
-	}
+	/* NOTE(omid): Render tunnel. Every profiled phase flushes its own
+	 * rects so their draw cost isn't billed to the next phase. */
+	begin_profile_block(profiler, PROFILE_RENDER_TUNNEL);
+	render_tunnel(game, renderer, scale);
+	flush_rect_batch(renderer);
+	end_profile_block(profiler, PROFILE_RENDER_TUNNEL);
 
 	/* NOTE(omid): Render entities. */
 	if (true) {
+		begin_profile_block(profiler, PROFILE_RENDER_ENTITIES);
 		for (u32 sort_list_index = 0; sort_list_index < game->entity_count; ++sort_list_index) {
 			u32 entity_index = game->entity_index_by_z[sort_list_index];
 			struct entity *entity = game->entities + entity_index;
@@ -3374,18 +6173,15 @@ render_game(struct game_state *game,
 			}
 
 			if (entity->type == ENTITY_LIGHTNING) {
-				u32 from_entity_index, to_entity_index;
-				if (find_entity_by_id(game, entity->from_id, &from_entity_index) &&
-				    find_entity_by_id(game, entity->to_id, &to_entity_index)) {
-					struct entity *e1 = game->entities + from_entity_index;
-					struct entity *e2 = game->entities + to_entity_index;
-
+				struct entity *e1 = find_entity(game, entity->from);
+				struct entity *e2 = find_entity(game, entity->to);
+				if (e1 && e2) {
 					if (entity->from_part_index < e1->part_count &&
 					    entity->to_part_index < e2->part_count) {
 						struct entity_part *p1 = e1->parts + entity->from_part_index;
 						struct entity_part *p2 = e2->parts + entity->to_part_index;
 
-						f32 r = ((f32)entity->seed / (f32)RAND_MAX);
+						f32 r = ((f32)entity->seed / 4294967296.0f);
 						f32 t = (game->time - entity->spawn_t) / 3 + 1.75f * 4;
 						f32 ttl = entity->expiration_t - game->time;
 						f32 z = ttl * 10;
@@ -3395,33 +6191,20 @@ render_game(struct game_state *game,
 				}
 			}
 		}
-
-		for (u32 particle_index = 0; particle_index < game->particle_count; ++particle_index) {
-			f32 ttl = game->particles[particle_index].expiration_t - game->time;
-			if (ttl < 0)
-				continue;
-
-			struct entity_part *part = &game->particles[particle_index].part;
-			struct v2 part_p = part->p;
-			u8 c = (u8)part->color;
-			if (c == UINT8_MAX)
-				continue;
-
-			struct color color = BASE_COLORS[c];
-			if (ttl < 1)
-				color.a = (u8)(ttl * 0xff);
-			fill_rotated_rect(game, renderer, (s32)part_p.x, (s32)part_p.y, (s32)part->width, (s32)part->height, (f64)part->angle, color);
-
-			/* if (ttl > 0 && ttl < 1) */
-			/* 	render_entity_part(game, renderer, &game->particles[particle_index].part, ttl, scale); */
-			/* else */
-			/* 	render_entity_part(game, renderer, &game->particles[particle_index].part, 1, scale); */
-		}
+		flush_rect_batch(renderer);
+		end_profile_block(profiler, PROFILE_RENDER_ENTITIES);
+
+		begin_profile_block(profiler, PROFILE_RENDER_PARTICLES);
+		render_fx_particles(game, renderer);
+		render_particles(game, renderer);
+		flush_rect_batch(renderer);
+		end_profile_block(profiler, PROFILE_RENDER_PARTICLES);
 	}
 
+	begin_profile_block(profiler, PROFILE_RENDER_HUD);
 	if (game->shield_active && game->shield_energy > 0) {
-		if (find_entity_by_id(game, game->player_id, &game->player_index)) {
-			struct entity *player = game->entities + game->player_index;
+		struct entity *player = find_player(game);
+		if (player) {
 			if (player->part_count) {
 				struct entity_part *p = player->parts;
 
@@ -3431,7 +6214,7 @@ render_game(struct game_state *game,
 	}
 
 	/* SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE); */
-	SDL_RenderSetScale(renderer, 1, 1);
+	set_render_scale(renderer, 1, 1);
 
 	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
 		const struct entity *entity = game->entities + entity_index;
@@ -3488,9 +6271,7 @@ render_game(struct game_state *game,
 
 				fill_rect(renderer, x, top, width, height, color(0xff, 0xff, 0xff, alpha));
 
-				struct sound *s = push_sound(game, SINE, step * 10, 0.5f);
-				if (s)
-					s->once = true;
+				queue_sound(game, SINE, step * 10, 0.5f);
 			}
 
 			if (!game->did_select_card || game->selected_card == i)
@@ -3499,9 +6280,9 @@ render_game(struct game_state *game,
 		}
 	}
 
-	if (find_entity_by_id(game, game->player_id, &game->player_index)) {
+	struct entity *player = find_player(game);
+	if (player) {
 		s32 y = 5 + SMALL_FONT_SIZE;
-		struct entity *player = game->entities + game->player_index;
 		struct color c = color(0xff, 0xff, 0xff, 0xff);
 
 		draw_string_f(renderer, small_font, 25, y, TEXT_ALIGN_LEFT, white, "SHIELD");
@@ -3521,8 +6302,11 @@ render_game(struct game_state *game,
 			y += SMALL_FONT_SIZE + 3;
 		}
 	}
+	flush_rect_batch(renderer);
+	end_profile_block(profiler, PROFILE_RENDER_HUD);
 
 	/* NOTE(omid): Render on-screen text. */
+	begin_profile_block(profiler, PROFILE_RENDER_TEXT);
 
 	/* draw_string(renderer, font, "LD48 - InvertedMinds", 5, 5, TEXT_ALIGN_LEFT, white); */
 #if 0
@@ -3587,43 +6371,218 @@ render_game(struct game_state *game,
 		f32 z = 1 + (f32)score_delta / 100;
 		if (z > 2)
 			z = 2;
-		SDL_RenderSetScale(renderer, z, z);
+		set_render_scale(renderer, z, z);
 		draw_string_f(renderer, font, (s32)(WINDOW_WIDTH / 2 / z), (s32)((5 + SMALL_FONT_SIZE) / z), TEXT_ALIGN_CENTER, white, "%u", game->visible_score);
-		SDL_RenderSetScale(renderer, 1, 1);
+		set_render_scale(renderer, 1, 1);
 	} else {
 		draw_string_f(renderer, font, WINDOW_WIDTH / 2, 5 + SMALL_FONT_SIZE, TEXT_ALIGN_CENTER, white, "%u", game->visible_score);
 	}
+	flush_rect_batch(renderer);
+	end_profile_block(profiler, PROFILE_RENDER_TEXT);
 
-	if (false) {
-		s32 y = 5 + SMALL_FONT_SIZE;
-		for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
-			const struct entity *entity = game->entities + entity_index;
-			draw_string_f(renderer, small_font, 5, y, TEXT_ALIGN_LEFT, white, "E (%u): HAS TARGET? %s [(%f, %f) * %f]", entity_index, entity->has_target ? "YES" : "NO", (f64)entity->target.x, (f64)entity->target.y, (f64)entity->pull_of_target);
-			y += SMALL_FONT_SIZE;
+	if (profiler->visible) {
+		render_audio_spectrum(game, renderer);
+		render_debug_dump(game, renderer, small_font);
+		render_profiler(profiler, renderer, small_font);
+	}
 
-			for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
-				const struct entity_part *part = entity->parts + (entity->part_count - part_index - 1);
-				draw_string_f(renderer, small_font, 25, y, TEXT_ALIGN_LEFT, white, "E (%u, %u): (%f, %f)", entity_index, part_index, (f64)part->p.x, (f64)part->p.y);
-				y += SMALL_FONT_SIZE;
-			}
+	flush_rect_batch(renderer);
+	SDL_RenderPresent(renderer);
+}
+
+static f32
+saw_from_phase(u32 phase)
+{
+	/* NOTE(omid): Flipping the top bit turns the phase into a signed
+	 * offset from the middle of the cycle, so the signed int to float
+	 * conversion lands directly on [-0.5, 0.5). */
+	return (f32)(s32)(phase ^ 0x80000000u) * (1.0f / 4294967296.0f);
+}
+
+static f32
+sound_block_amp(const struct sound *sound, f32 global_t)
+{
+	f32 amp = sound->wave.amp;
+	if (sound->fadeout && sound->fadeout_begin > global_t && (sound->fadeout_end > sound->fadeout_begin))
+		amp *= (global_t - sound->fadeout_begin) / (sound->fadeout_end - sound->fadeout_begin);
+	return amp;
+}
+
+static f32
+next_noise_sample(struct random_series *series)
+{
+	/* NOTE(omid): [-1, 1). */
+	return (f32)next_random_u32(series) * (2.0f / 4294967296.0f) - 1;
+}
+
+static void
+mix_noise_block(struct random_series *series, f32 amp, f32 *accum, u32 count)
+{
+	for (u32 i = 0; i < count; ++i)
+		accum[i] += amp * next_noise_sample(series);
+}
+
+static void
+mix_sine_block_scalar(const f32 *table, struct sound *sound, f32 amp, f32 *accum, u32 count)
+{
+	u32 phase = sound->phase;
+	for (u32 i = 0; i < count; ++i) {
+		accum[i] += sample_sine_table(table, phase) * amp;
+		phase += sound->phase_step;
+	}
+	sound->phase = phase;
+}
+
+static void
+mix_saw_block_scalar(struct sound *sound, f32 amp, f32 *accum, u32 count)
+{
+	u32 phase = sound->phase;
+	for (u32 i = 0; i < count; ++i) {
+		accum[i] += saw_from_phase(phase) * amp;
+		phase += sound->phase_step;
+	}
+	sound->phase = phase;
+}
+
+static void
+mix_sounds_scalar(struct game_state *game, f32 global_t, f32 *accum, u32 count)
+{
+	zero_memory(accum, sizeof(f32) * count);
+
+	for (u32 sound_index = 0; sound_index < game->sound_count; ++sound_index) {
+		struct sound *sound = game->sounds + sound_index;
+		if (sound->play_begin > global_t || sound->silenced)
+			continue;
+
+		f32 amp = sound_block_amp(sound, global_t);
+		switch (sound->type) {
+		case SINE:
+			mix_sine_block_scalar(game->sine_table, sound, amp, accum, count);
+			break;
+
+		case SAW:
+			mix_saw_block_scalar(sound, amp, accum, count);
+			break;
+
+		case WHITENOISE:
+			mix_noise_block(&sound->random, amp, accum, count);
+			break;
 		}
 	}
+}
 
-	if (false) {
-		s32 y = 5 + SMALL_FONT_SIZE;
-		u32 visible_count = WINDOW_HEIGHT / TUNNEL_SEGMENT_THICKNESS;
+static void
+clamp_mix_scalar(const f32 *accum, f32 *out, u32 count)
+{
+	for (u32 i = 0; i < count; ++i) {
+		f32 mix = accum[i];
+		if (mix < -1.0f)
+			mix = -1.0f;
+		else if (mix > 1.0f)
+			mix = 1.0f;
+		out[i] = mix;
+	}
+}
 
-		for (u32 i = 0; i < visible_count; ++i) {
-			u32 segment_index = (game->current_tunnel_segment - i) & (TUNNEL_SEGMENT_COUNT - 1);
-			struct tunnel_segment segment = game->tunnel_segments[segment_index];
-			draw_string_f(renderer, small_font, 25, y, TEXT_ALIGN_LEFT, white, "SEGMENT: %u, %u", segment.left, segment.right);
-			y += SMALL_FONT_SIZE;
+#if defined(__SSE2__)
+static void
+mix_sine_block_sse2(const f32 *table, struct sound *sound, f32 amp, f32 *accum, u32 count)
+{
+	u32 step = sound->phase_step;
+	u32 wide_count = count & ~3u;
+
+	__m128i phases = _mm_add_epi32(_mm_set1_epi32((s32)sound->phase), _mm_set_epi32((s32)(3 * step), (s32)(2 * step), (s32)step, 0));
+	__m128i wide_step = _mm_set1_epi32((s32)(4 * step));
+	__m128i frac_mask = _mm_set1_epi32((1 << (32 - SINE_TABLE_BITS)) - 1);
+	__m128 frac_scale = _mm_set1_ps(1.0f / (f32)(1u << (32 - SINE_TABLE_BITS)));
+	__m128 wide_amp = _mm_set1_ps(amp);
+
+	for (u32 i = 0; i < wide_count; i += 4) {
+		/* NOTE(omid): SSE2 has no gather, so only the table reads are scalar. */
+		u32 index[4];
+		_mm_storeu_si128((__m128i *)(void *)index, _mm_srli_epi32(phases, 32 - SINE_TABLE_BITS));
+		__m128 a = _mm_set_ps(table[index[3]], table[index[2]], table[index[1]], table[index[0]]);
+		__m128 b = _mm_set_ps(table[index[3] + 1], table[index[2] + 1], table[index[1] + 1], table[index[0] + 1]);
+		__m128 frac = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(phases, frac_mask)), frac_scale);
+		__m128 w = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), frac));
+
+		_mm_storeu_ps(accum + i, _mm_add_ps(_mm_loadu_ps(accum + i), _mm_mul_ps(w, wide_amp)));
+		phases = _mm_add_epi32(phases, wide_step);
+	}
+
+	sound->phase += step * wide_count;
+	mix_sine_block_scalar(table, sound, amp, accum + wide_count, count - wide_count);
+}
+
+static void
+mix_saw_block_sse2(struct sound *sound, f32 amp, f32 *accum, u32 count)
+{
+	u32 step = sound->phase_step;
+	u32 wide_count = count & ~3u;
+
+	__m128i phases = _mm_add_epi32(_mm_set1_epi32((s32)sound->phase), _mm_set_epi32((s32)(3 * step), (s32)(2 * step), (s32)step, 0));
+	__m128i wide_step = _mm_set1_epi32((s32)(4 * step));
+	__m128i top_bit = _mm_set1_epi32((s32)0x80000000u);
+	__m128 phase_scale = _mm_set1_ps(1.0f / 4294967296.0f);
+	__m128 wide_amp = _mm_set1_ps(amp);
+
+	for (u32 i = 0; i < wide_count; i += 4) {
+		__m128 w = _mm_mul_ps(_mm_cvtepi32_ps(_mm_xor_si128(phases, top_bit)), phase_scale);
+		_mm_storeu_ps(accum + i, _mm_add_ps(_mm_loadu_ps(accum + i), _mm_mul_ps(w, wide_amp)));
+		phases = _mm_add_epi32(phases, wide_step);
+	}
+
+	sound->phase += step * wide_count;
+	mix_saw_block_scalar(sound, amp, accum + wide_count, count - wide_count);
+}
+
+static void
+mix_sounds_sse2(struct game_state *game, f32 global_t, f32 *accum, u32 count)
+{
+	zero_memory(accum, sizeof(f32) * count);
+
+	for (u32 sound_index = 0; sound_index < game->sound_count; ++sound_index) {
+		struct sound *sound = game->sounds + sound_index;
+		if (sound->play_begin > global_t || sound->silenced)
+			continue;
+
+		f32 amp = sound_block_amp(sound, global_t);
+		switch (sound->type) {
+		case SINE:
+			mix_sine_block_sse2(game->sine_table, sound, amp, accum, count);
+			break;
+
+		case SAW:
+			mix_saw_block_sse2(sound, amp, accum, count);
+			break;
+
+		case WHITENOISE:
+			mix_noise_block(&sound->random, amp, accum, count);
+			break;
 		}
 	}
+}
 
-	SDL_RenderPresent(renderer);
+static void
+clamp_mix_sse2(const f32 *accum, f32 *out, u32 count)
+{
+	u32 wide_count = count & ~3u;
+	__m128 lo = _mm_set1_ps(-1.0f);
+	__m128 hi = _mm_set1_ps(1.0f);
+	for (u32 i = 0; i < wide_count; i += 4)
+		_mm_storeu_ps(out + i, _mm_min_ps(_mm_max_ps(_mm_loadu_ps(accum + i), lo), hi));
+
+	clamp_mix_scalar(accum + wide_count, out + wide_count, count - wide_count);
 }
 
+#define mix_sounds mix_sounds_sse2
+#define clamp_mix clamp_mix_sse2
+#else
+/* NOTE(omid): WASM builds don't enable SIMD, use the scalar block mixer. */
+#define mix_sounds mix_sounds_scalar
+#define clamp_mix clamp_mix_scalar
+#endif
+
 static void
 mix_audio(void *state, Uint8 *stream, int len)
 {
@@ -3632,6 +6591,8 @@ mix_audio(void *state, Uint8 *stream, int len)
 	u32 length = (u32)(len / 4);
 	f32 *s = (f32 *)(void *)stream;
 
+	apply_sound_commands(game);
+
 	if (game->game_over)
 		play_track(game, 1);
 	else if (game->card_select_mode)
@@ -3648,14 +6609,8 @@ mix_audio(void *state, Uint8 *stream, int len)
 		if (sound->fadeout && sound->fadeout_end < global_t)
 			sound->disposed = true;
 
-		if (sound->disposed && sound->echo) {
-			struct sound *echo = push_sound(game, sound->type, sound->wave.freq, sound->wave.amp * 0.5f);
-			if (echo) {
-				echo->echo = echo->wave.amp > 0.1f;
-				echo->fadeout = true;
-				echo->fadeout_end = global_t + 0.1f;
-			}
-		}
+		if (sound->disposed && sound->echo)
+			push_sound_echo(game, sound, global_t);
 
 		if (sound->disposed) {
 			game->sounds[sound_index] = game->sounds[--game->sound_count];
@@ -3665,79 +6620,384 @@ mix_audio(void *state, Uint8 *stream, int len)
 		if (sound->once)
 			sound->disposed = true;
 
-		++sound_index;
+		++sound_index;
+	}
+
+	f32 accum[AUDIO_SAMPLE_COUNT];
+	for (u32 offset = 0; offset < length; offset += AUDIO_SAMPLE_COUNT) {
+		u32 count = min_u(length - offset, AUDIO_SAMPLE_COUNT);
+
+		/* NOTE(omid): Split the block at every note so each one starts
+		 * or stops on its exact sample. */
+		u32 mixed = 0;
+		while (mixed < count) {
+			u64 sample_index = game->played_audio_sample_count + offset + mixed;
+			u64 next_note = sequence_track(game, sample_index);
+			u32 segment = count - mixed;
+			if (next_note - sample_index < segment)
+				segment = (u32)(next_note - sample_index);
+
+			mix_sounds(game, global_t, accum + mixed, segment);
+			mixed += segment;
+		}
+
+		clamp_mix(accum, s + offset, count);
+	}
+
+	u32 visible_count = min_u(length, (u32)ARRAY_COUNT(game->last_audio_mix));
+	memcpy(game->last_audio_mix, s, sizeof(f32) * visible_count);
+
+	game->played_audio_sample_count += length;
+}
+
+
+static SDL_Window *window;
+static SDL_Renderer *renderer;
+static SDL_AudioDeviceID audio;
+static const char *font_name;
+static TTF_Font *font;
+static TTF_Font *small_font;
+
+
+static struct input_state input;
+static bool quit;
+
+static s32 window_w, window_h, renderer_w, renderer_h;
+static f32 default_scale = 1;
+
+
+static void
+compute_input_deltas(struct input_state *input, const struct input_state *prev_input)
+{
+	input->dleft = (s8)(input->left - prev_input->left);
+	input->dright = (s8)(input->right - prev_input->right);
+	input->dup = (s8)(input->up - prev_input->up);
+	input->ddown = (s8)(input->down - prev_input->down);
+	input->dstart = (s8)(input->start - prev_input->start);
+	input->daction = (s8)(input->action - prev_input->action);
+
+	input->dspeed_up = (s8)(input->speed_up - prev_input->speed_up);
+	input->dspeed_down = (s8)(input->speed_down - prev_input->speed_down);
+
+	input->dtoggle_profiler = (s8)(input->toggle_profiler - prev_input->toggle_profiler);
+}
+
+/* NOTE(omid): A replay is the game seed followed by one packed
+ * input_state per simulated frame. The simulation reads nothing else from
+ * outside (time is frame_index / 60, audio noise has its own state), so
+ * feeding the frames back reproduces a run exactly, windowed or headless. */
+#define REPLAY_MAGIC 0x5230354Cu /* "L50R" */
+#define REPLAY_VERSION 1
+
+enum replay_button {
+	REPLAY_BUTTON_LEFT            = (1 << 0),
+	REPLAY_BUTTON_RIGHT           = (1 << 1),
+	REPLAY_BUTTON_UP              = (1 << 2),
+	REPLAY_BUTTON_DOWN            = (1 << 3),
+	REPLAY_BUTTON_ACTION          = (1 << 4),
+	REPLAY_BUTTON_START           = (1 << 5),
+	REPLAY_BUTTON_SPEED_UP        = (1 << 6),
+	REPLAY_BUTTON_SPEED_DOWN      = (1 << 7),
+	REPLAY_BUTTON_TOGGLE_PROFILER = (1 << 8)
+};
+
+struct replay_header {
+	u32 magic;
+	u32 version;
+	u32 seed;
+	u32 frame_size;
+};
+
+struct replay_frame {
+	u16 buttons;
+	s16 mouse_x;
+	s16 mouse_y;
+	u8 mouse_buttons;
+	u8 pad_;
+};
+
+struct replay {
+	FILE *record_file;
+	struct replay_frame *frames;
+	u32 frame_count;
+	u32 next_frame;
+	u32 seed;
+};
+
+static struct replay replay;
+
+static b32
+begin_replay_recording(struct replay *replay, const char *filename, u32 seed)
+{
+	replay->record_file = fopen(filename, "wb");
+	if (!replay->record_file)
+		return false;
+
+	struct replay_header header = { REPLAY_MAGIC, REPLAY_VERSION, seed, sizeof(struct replay_frame) };
+	fwrite(&header, sizeof(header), 1, replay->record_file);
+	return true;
+}
+
+static void
+record_replay_frame(struct replay *replay, const struct input_state *input)
+{
+	if (!replay->record_file)
+		return;
+
+	struct replay_frame frame = { 0 };
+	frame.buttons = (u16)((input->left ? REPLAY_BUTTON_LEFT : 0) |
+			      (input->right ? REPLAY_BUTTON_RIGHT : 0) |
+			      (input->up ? REPLAY_BUTTON_UP : 0) |
+			      (input->down ? REPLAY_BUTTON_DOWN : 0) |
+			      (input->action ? REPLAY_BUTTON_ACTION : 0) |
+			      (input->start ? REPLAY_BUTTON_START : 0) |
+			      (input->speed_up ? REPLAY_BUTTON_SPEED_UP : 0) |
+			      (input->speed_down ? REPLAY_BUTTON_SPEED_DOWN : 0) |
+			      (input->toggle_profiler ? REPLAY_BUTTON_TOGGLE_PROFILER : 0));
+	frame.mouse_x = input->mouse_x;
+	frame.mouse_y = input->mouse_y;
+	frame.mouse_buttons = input->mouse_buttons;
+	fwrite(&frame, sizeof(frame), 1, replay->record_file);
+}
+
+static b32
+load_replay(struct replay *replay, const char *filename)
+{
+	FILE *file = fopen(filename, "rb");
+	if (!file)
+		return false;
+
+	struct replay_header header;
+	b32 valid = fread(&header, sizeof(header), 1, file) == 1 &&
+		header.magic == REPLAY_MAGIC &&
+		header.version == REPLAY_VERSION &&
+		header.frame_size == sizeof(struct replay_frame);
+
+	long end = -1;
+	if (valid && fseek(file, 0, SEEK_END) == 0)
+		end = ftell(file);
+
+	valid = valid && end >= (long)sizeof(header) &&
+		fseek(file, (long)sizeof(header), SEEK_SET) == 0;
+
+	if (valid) {
+		u32 frame_count = (u32)(((size_t)end - sizeof(header)) / sizeof(struct replay_frame));
+		replay->frames = malloc(sizeof(struct replay_frame) * (frame_count + 1));
+		valid = replay->frames && fread(replay->frames, sizeof(struct replay_frame), frame_count, file) == frame_count;
+		replay->frame_count = frame_count;
+		replay->next_frame = 0;
+		replay->seed = header.seed;
+	}
+
+	fclose(file);
+	return valid;
+}
+
+static b32
+next_replay_input(struct replay *replay, struct input_state *input)
+{
+	if (replay->next_frame >= replay->frame_count)
+		return false;
+
+	struct replay_frame frame = replay->frames[replay->next_frame++];
+
+	ZERO_STRUCT(*input);
+	input->left = (frame.buttons & REPLAY_BUTTON_LEFT) != 0;
+	input->right = (frame.buttons & REPLAY_BUTTON_RIGHT) != 0;
+	input->up = (frame.buttons & REPLAY_BUTTON_UP) != 0;
+	input->down = (frame.buttons & REPLAY_BUTTON_DOWN) != 0;
+	input->action = (frame.buttons & REPLAY_BUTTON_ACTION) != 0;
+	input->start = (frame.buttons & REPLAY_BUTTON_START) != 0;
+	input->speed_up = (frame.buttons & REPLAY_BUTTON_SPEED_UP) != 0;
+	input->speed_down = (frame.buttons & REPLAY_BUTTON_SPEED_DOWN) != 0;
+	input->toggle_profiler = (frame.buttons & REPLAY_BUTTON_TOGGLE_PROFILER) != 0;
+	input->mouse_x = frame.mouse_x;
+	input->mouse_y = frame.mouse_y;
+	input->mouse_buttons = frame.mouse_buttons;
+	return true;
+}
+
+static void
+end_replay(struct replay *replay)
+{
+	if (replay->record_file)
+		fclose(replay->record_file);
+	free(replay->frames);
+	ZERO_STRUCT(*replay);
+}
+
+/* NOTE(omid): FNV-1a, but a 32-bit word at a time; a trailing partial
+ * word is zero padded. Floats are hashed as bits, so -0 and 0 differ. */
+static u64
+hash_words(u64 hash, const void *data, size_t size)
+{
+	const u8 *bytes = data;
+	size_t i = 0;
+	for (; i + 4 <= size; i += 4) {
+		u32 word;
+		memcpy(&word, bytes + i, 4);
+		hash = (hash ^ word) * 1099511628211ull;
+	}
+	if (i < size) {
+		u32 word = 0;
+		memcpy(&word, bytes + i, size - i);
+		hash = (hash ^ word) * 1099511628211ull;
+	}
+	return hash;
+}
+
+/* NOTE(omid): Only what the simulation carries from frame to frame and
+ * what optimisations are likely to disturb: entity parts, gameplay
+ * particles, the tunnel and the score. FX particles, sounds and caches
+ * are left out. */
+static u64
+hash_game_state(const struct game_state *game)
+{
+	u64 hash = 14695981039346656037ull;
+
+	hash = hash_words(hash, &game->current_level, sizeof(game->current_level));
+	hash = hash_words(hash, &game->score, sizeof(game->score));
+	hash = hash_words(hash, &game->entity_count, sizeof(game->entity_count));
+
+	for (u32 entity_index = 0; entity_index < game->entity_count; ++entity_index) {
+		const struct entity *entity = game->entities + entity_index;
+		hash = hash_words(hash, &entity->type, sizeof(entity->type));
+		hash = hash_words(hash, &entity->part_count, sizeof(entity->part_count));
+		for (u32 part_index = 0; part_index < entity->part_count; ++part_index) {
+			const struct entity_part *part = entity->parts + part_index;
+			hash = hash_words(hash, &part->p, sizeof(part->p));
+			hash = hash_words(hash, &part->v, sizeof(part->v));
+			hash = hash_words(hash, &part->hp, sizeof(part->hp));
+		}
+	}
+
+	const struct particle_store *particles = &game->particles;
+	u32 count = particles->count;
+	hash = hash_words(hash, &count, sizeof(count));
+	hash = hash_words(hash, particles->p_x, sizeof(f32) * count);
+	hash = hash_words(hash, particles->p_y, sizeof(f32) * count);
+	hash = hash_words(hash, particles->v_x, sizeof(f32) * count);
+	hash = hash_words(hash, particles->v_y, sizeof(f32) * count);
+	hash = hash_words(hash, particles->type, sizeof(u16) * count);
+
+	hash = hash_words(hash, &game->current_tunnel_segment, sizeof(game->current_tunnel_segment));
+	hash = hash_words(hash, game->tunnel_segments, sizeof(game->tunnel_segments));
+
+	return hash;
+}
+
+/* NOTE(omid): Writes "frame hash" lines every 'interval' frames and/or
+ * compares against such a file from an earlier run. Reference lines for
+ * frames this run does not sample are skipped, so the intervals only
+ * need to share frames, not match. */
+struct checksum_stream {
+	FILE *file;
+	FILE *reference;
+	u32 interval;
+	b32 has_reference;
+
+	b32 has_reference_line;
+	u32 reference_frame;
+	u64 reference_hash;
+
+	u32 compared_count;
+	b32 diverged;
+	u32 divergent_frame;
+	u32 last_matched_frame;
+	b32 has_matched;
+};
+
+static struct checksum_stream checksum_stream;
+
+static b32
+begin_checksum_stream(struct checksum_stream *stream, const char *filename, const char *reference_filename, u32 interval)
+{
+	stream->interval = interval ? interval : 1;
+
+	if (filename) {
+		stream->file = fopen(filename, "w");
+		if (!stream->file)
+			return false;
+	}
+
+	if (reference_filename) {
+		stream->reference = fopen(reference_filename, "r");
+		if (!stream->reference)
+			return false;
+		stream->has_reference = true;
 	}
 
-	for (u32 i = 0; i < length; ++i) {
-		f32 t = (f32)(game->played_audio_sample_count + i) / AUDIO_FREQ;
+	return true;
+}
 
-		f32 mix = 0;
-		for (sound_index = 0; sound_index < game->sound_count; ++sound_index) {
-			struct sound sound = game->sounds[sound_index];
+static void
+update_checksum_stream(struct checksum_stream *stream, const struct game_state *game)
+{
+	if (!stream->file && !stream->reference)
+		return;
 
-			if (sound.play_begin > global_t)
-				continue;
+	u32 frame_index = game->frame_index;
+	if (frame_index % stream->interval)
+		return;
 
-			f32 w = 0;
-			switch (sound.type) {
-			case SINE:
-				w = sinf(2.0f * 3.14f * sound.wave.freq * t) * sound.wave.amp;
-				break;
+	u64 hash = hash_game_state(game);
 
-			case SAW:
-				if (!IS_F32_ZERO(sound.wave.amp))
-					w = fmodf(sound.wave.amp * sound.wave.freq * t, sound.wave.amp) - sound.wave.amp / 2;
-				break;
+	if (stream->file)
+		fprintf(stream->file, "%u %016llx\n", frame_index, (unsigned long long)hash);
 
-			case WHITENOISE:
-				w = sound.wave.amp * (2 * random_f32() - 1);
+	while (stream->reference && !stream->diverged) {
+		if (!stream->has_reference_line) {
+			unsigned long long reference_hash;
+			if (fscanf(stream->reference, "%u %llx", &stream->reference_frame, &reference_hash) != 2) {
+				fclose(stream->reference);
+				stream->reference = 0;
 				break;
 			}
-
-			if (sound.fadeout && sound.fadeout_begin > global_t && (sound.fadeout_end > sound.fadeout_begin)) {
-				f32 fade = (global_t - sound.fadeout_begin) / (sound.fadeout_end - sound.fadeout_begin);
-				w *= fade;
-			}
-
-			mix += w;
+			stream->reference_hash = reference_hash;
+			stream->has_reference_line = true;
 		}
 
-		if (mix < -1.0f)
-			mix = -1.0f;
-		else if (mix > 1.0f)
-			mix = 1.0f;
-
-		s[i] = mix;
+		if (stream->reference_frame > frame_index)
+			break;
 
-		if (i < ARRAY_COUNT(game->last_audio_mix)) {
-			f32 window = 1;
-			/* if (i < 100) */
-			/* 	window = (f32)i / 100.0f; */
-			/* else if (i > (length - 100)) */
-			/* 	window = (f32)(length - i) / 100.0f; */
+		stream->has_reference_line = false;
+		if (stream->reference_frame < frame_index)
+			continue;
 
-			game->last_audio_mix[i] = mix * window * window;
+		++stream->compared_count;
+		if (stream->reference_hash == hash) {
+			stream->last_matched_frame = frame_index;
+			stream->has_matched = true;
+		} else {
+			stream->diverged = true;
+			stream->divergent_frame = frame_index;
 		}
+		break;
 	}
-
-	game->played_audio_sample_count += length;
 }
 
+static b32
+end_checksum_stream(struct checksum_stream *stream)
+{
+	b32 diverged = stream->diverged;
+
+	if (stream->diverged) {
+		if (stream->has_matched)
+			printf("checksum: diverged from reference at frame %u, last match at frame %u\n", stream->divergent_frame, stream->last_matched_frame);
+		else
+			printf("checksum: diverged from reference at frame %u, no earlier match\n", stream->divergent_frame);
+	} else if (stream->has_reference) {
+		printf("checksum: %u frames match the reference\n", stream->compared_count);
+	}
 
-static SDL_Window *window;
-static SDL_Renderer *renderer;
-static SDL_AudioDeviceID audio;
-static const char *font_name;
-static TTF_Font *font;
-static TTF_Font *small_font;
-
-
-static struct input_state input;
-static bool quit;
-
-static s32 window_w, window_h, renderer_w, renderer_h;
-static f32 default_scale = 1;
+	if (stream->file)
+		fclose(stream->file);
+	if (stream->reference)
+		fclose(stream->reference);
+	ZERO_STRUCT(*stream);
 
+	return diverged;
+}
 
 static void
 update_and_render()
@@ -3746,9 +7006,14 @@ update_and_render()
 
 	for (u32 i = 0; i < (game->time_speed_up + 1); ++i) {
 		SDL_Event e;
-		while (SDL_PollEvent(&e) != 0)
+		while (SDL_PollEvent(&e) != 0) {
 			if (e.type == SDL_QUIT)
 				quit = true;
+			else if (e.type == SDL_RENDER_TARGETS_RESET)
+				invalidate_tunnel_cache();
+			else if (e.type == SDL_RENDER_DEVICE_RESET)
+				reset_tunnel_cache_texture();
+		}
 
 		s32 key_count;
 		const u8 *key_states = SDL_GetKeyboardState(&key_count);
@@ -3758,25 +7023,35 @@ update_and_render()
 
 		struct input_state prev_input = input;
 
-		input.left = key_states[SDL_SCANCODE_LEFT];
-		input.right = key_states[SDL_SCANCODE_RIGHT];
-		input.up = key_states[SDL_SCANCODE_UP];
-		input.down = key_states[SDL_SCANCODE_DOWN];
-		input.start = key_states[SDL_SCANCODE_RETURN];
-		input.action = key_states[SDL_SCANCODE_SPACE];
+		if (replay.frames) {
+			if (!next_replay_input(&replay, &input)) {
+				quit = true;
+				break;
+			}
+		} else {
+			input.left = key_states[SDL_SCANCODE_LEFT];
+			input.right = key_states[SDL_SCANCODE_RIGHT];
+			input.up = key_states[SDL_SCANCODE_UP];
+			input.down = key_states[SDL_SCANCODE_DOWN];
+			input.start = key_states[SDL_SCANCODE_RETURN];
+			input.action = key_states[SDL_SCANCODE_SPACE];
 
-		input.speed_up = key_states[SDL_SCANCODE_PAGEUP];
-		input.speed_down = key_states[SDL_SCANCODE_PAGEDOWN];
+			input.speed_up = key_states[SDL_SCANCODE_PAGEUP];
+			input.speed_down = key_states[SDL_SCANCODE_PAGEDOWN];
+
+			input.toggle_profiler = key_states[SDL_SCANCODE_F1];
+
+			s32 mouse_x, mouse_y;
+			input.mouse_buttons = (u8)SDL_GetMouseState(&mouse_x, &mouse_y);
+			input.mouse_x = (s16)mouse_x;
+			input.mouse_y = (s16)mouse_y;
+		}
 
-		input.dleft = (s8)(input.left - prev_input.left);
-		input.dright = (s8)(input.right - prev_input.right);
-		input.dup = (s8)(input.up - prev_input.up);
-		input.ddown = (s8)(input.down - prev_input.down);
-		input.dstart = (s8)(input.start - prev_input.start);
-		input.daction = (s8)(input.action - prev_input.action);
+		record_replay_frame(&replay, &input);
+		compute_input_deltas(&input, &prev_input);
 
-		input.dspeed_up = (s8)(input.speed_up - prev_input.speed_up);
-		input.dspeed_down = (s8)(input.speed_down - prev_input.speed_down);
+		if (input.dtoggle_profiler > 0)
+			game->profiler.visible = !game->profiler.visible;
 
 #if 0
 		if (input.dspeed_up > 0)
@@ -3810,9 +7085,12 @@ update_and_render()
 #endif
 		game->real_time = (f32)(SDL_GetTicks()) / 1000.0f;
 		update_game(game, &input);
+		update_checksum_stream(&checksum_stream, game);
 		if (i == 0)
 			render_game(game, renderer, font, small_font);
 
+		end_profile_frame(&game->profiler, game->frame_index);
+
 		++game->frame_index;
 	}
 }
@@ -3846,18 +7124,34 @@ read_entire_file(const char* filename, size_t *size_out)
     return result;
 }
 
+static void
+init_note_freq_table(u16 *note_freq)
+{
+	for (u32 note = 0; note < 128; ++note)
+		note_freq[note] = (u16)(440 * pow(2, ((f64)note - 69.0) / 12.0));
+}
+
 static struct track *
-load_track(struct game_state *game, const char *filename)
+load_track(struct game_state *game, const char *filename, u32 tempo_inverse_scale)
 {
-	size_t track_data_size;
+	u32 track_index = game->track_count++;
+	struct track *track = game->tracks + track_index;
+	ZERO_STRUCT(*track);
+
+	size_t track_data_size = 0;
 	u8 *data = read_entire_file(filename, &track_data_size);
+	if (!data)
+		return track;
+
 	u8 *p = data;
 	u32 track_event_count = (u32)(track_data_size / 7);
-	u32 track_index = game->track_count++;
-	struct track *track = game->tracks + track_index;
-	track->tempo_inverse_scale = 1200;
-	track->event_count = track_event_count;
-	track->events = malloc(sizeof(struct track_event) * track_event_count);
+	track->notes = malloc(sizeof(struct track_note) * track_event_count);
+
+	/* NOTE(omid): Resolve running status and the note on/off ranges the
+	 * old per-callback player used; events that don't start or stop a
+	 * note only contribute their delta time. */
+	u64 ticks = 0;
+	u8 last_status = 0;
 	for (u32 i = 0; i < track_event_count; ++i) {
 		struct track_event e;
 		memcpy(&e.t, p, 4);
@@ -3865,28 +7159,554 @@ load_track(struct game_state *game, const char *filename)
 		e.a = *(p++);
 		e.b = *(p++);
 		e.c = *(p++);
-		track->events[i] = e;
+
+		ticks += e.t;
+
+		struct track_note note = { .sample_offset = (u32)(ticks * AUDIO_FREQ / tempo_inverse_scale) };
+		b32 has_note = false;
+		if (e.a < 0x80) {
+			note.note = e.a;
+			note.velocity = e.b;
+			if (last_status <= 0x8f) {
+				note.type = TRACK_NOTE_OFF;
+				has_note = true;
+			} else if (last_status <= 0x9f) {
+				note.type = TRACK_NOTE_ON;
+				has_note = true;
+			}
+		} else {
+			note.note = e.b;
+			note.velocity = e.c;
+			if (e.a < 0x8f) {
+				note.type = TRACK_NOTE_OFF;
+				has_note = true;
+			} else if (e.a < 0x9f) {
+				note.type = TRACK_NOTE_ON_ACCENT;
+				has_note = true;
+			}
+			last_status = e.a;
+		}
+
+		if (has_note && note.note < 128)
+			track->notes[track->note_count++] = note;
 	}
 	free(data);
 
+	track->loop_sample_count = ticks * AUDIO_FREQ / tempo_inverse_scale;
+
 	return track;
 }
 
+static struct game_state *
+create_game_state(u32 seed)
+{
+	struct game_state *game = (struct game_state *)malloc(sizeof(struct game_state));
+	ZERO_STRUCT(*game);
+	init_entity_part_pool(&game->part_pool);
+	init_sine_table(game->sine_table);
+	init_fft_tables(&game->fft_tables);
+	game->seed = seed;
+	game->random = random_series_for_stream(seed, 0);
+	game->audio_random = random_series_for_stream(seed, 1);
+	/* game->level_end_t = -5; */
+	goto_level(game, 0);
+
+	game->profiler.ticks_to_ms = 1000.0 / (f64)SDL_GetPerformanceFrequency();
+
+	init_note_freq_table(game->note_freq);
+	load_track(game, "track.imm", 1200);
+	load_track(game, "track-2.imm", 1200);
+	load_track(game, "track-3.imm", 600);
+	load_track(game, "track-4.imm", 1200);
+
+	return game;
+}
+
+static void
+script_headless_input(struct game_state *game, struct input_state *input)
+{
+	/* NOTE(omid): Tap 'ENTER' every two seconds to skip banners, pick
+	 * cards and restart after game over, and steer the player along a
+	 * weaving line through the middle of the tunnel. */
+	u32 frame_index = game->frame_index;
+
+	ZERO_STRUCT(*input);
+	input->start = (frame_index % 120) == 0;
+	input->action = (frame_index % 600) < 60;
+
+	struct entity *player = find_player(game);
+	if (!player || !player->part_count)
+		return;
+
+	struct v2 p = player->parts->p;
+	u32 segment_index = (u32)(p.y / TUNNEL_SEGMENT_THICKNESS);
+	struct tunnel_segment segment = game->tunnel_segments[(game->current_tunnel_segment - segment_index) & (TUNNEL_SEGMENT_COUNT - 1)];
+	f32 center = ((f32)segment.left + (f32)(WINDOW_WIDTH - segment.right)) / 2;
+
+	struct v2 target = v2(center + 120 * sinf((f32)frame_index / 90.0f),
+			      WINDOW_HEIGHT * 0.75f + 80 * sinf((f32)frame_index / 150.0f));
+
+	input->left = p.x > target.x + 20;
+	input->right = p.x < target.x - 20;
+	input->up = p.y > target.y + 20;
+	input->down = p.y < target.y - 20;
+}
+
+static s32
+compare_f64(const void *x, const void *y)
+{
+	f64 a = *(const f64 *)x;
+	f64 b = *(const f64 *)y;
+	return a < b ? -1 : a > b;
+}
+
+static s32
+run_headless(u32 frame_count, u32 seed, const char *profile_csv, struct replay *replay, struct checksum_stream *checksums)
+{
+	struct game_state *game = create_game_state(seed);
+
+	if (profile_csv && !open_profile_csv(&game->profiler, profile_csv))
+		return 6;
+
+	f64 *frame_ms = malloc(sizeof(f64) * frame_count);
+	if (!frame_ms)
+		return 4;
+
+	struct input_state script_input = { 0 };
+	f32 audio_scratch[AUDIO_SAMPLE_COUNT];
+	u64 simulated_sample_count = 0;
+
+	f64 counter_to_ms = 1000.0 / (f64)SDL_GetPerformanceFrequency();
+	u64 total_begin = SDL_GetPerformanceCounter();
+
+	for (u32 i = 0; i < frame_count; ++i) {
+		struct input_state prev_input = script_input;
+		if (replay->frames)
+			next_replay_input(replay, &script_input);
+		else
+			script_headless_input(game, &script_input);
+		record_replay_frame(replay, &script_input);
+		compute_input_deltas(&script_input, &prev_input);
+
+		game->time = (f32)game->frame_index * (1.0f / 60);
+		game->real_time = game->time;
+
+		if (game->time > game->level_begin_t && game->skip_to_begin) {
+			game->skip_to_begin = false;
+			game->time_speed_up = 0;
+		}
+
+		u64 frame_begin = SDL_GetPerformanceCounter();
+		update_game(game, &script_input);
+		frame_ms[i] = (f64)(SDL_GetPerformanceCounter() - frame_begin) * counter_to_ms;
+
+		update_checksum_stream(checksums, game);
+
+		end_profile_frame(&game->profiler, game->frame_index);
+
+		/* NOTE(omid): Drain sounds the way the audio device would, so
+		 * sounds[] does not saturate; kept out of the frame timings. */
+		simulated_sample_count += AUDIO_FREQ / 60;
+		while (game->played_audio_sample_count + AUDIO_SAMPLE_COUNT <= simulated_sample_count)
+			mix_audio(game, (Uint8 *)audio_scratch, sizeof(audio_scratch));
+
+		++game->frame_index;
+	}
+
+	f64 total_ms = (f64)(SDL_GetPerformanceCounter() - total_begin) * counter_to_ms;
+
+	f64 update_ms = 0;
+	for (u32 i = 0; i < frame_count; ++i)
+		update_ms += frame_ms[i];
+
+	qsort(frame_ms, frame_count, sizeof(f64), compare_f64);
+
+	printf("headless: %u frames, seed %u, %u threads, level %u, score %u\n", frame_count, seed, job_system.worker_count, game->current_level + 1, game->score);
+	printf("simulated fps: %.1f (update_game only), %.1f (with audio drain)\n",
+	       (f64)frame_count * 1000.0 / update_ms, (f64)frame_count * 1000.0 / total_ms);
+	printf("frame ms: min %.4f, median %.4f, p99 %.4f, max %.4f\n",
+	       frame_ms[0], frame_ms[frame_count / 2], frame_ms[(frame_count * 99) / 100], frame_ms[frame_count - 1]);
+	printf("dropped: %u spawns, %u commands\n", game->commands.dropped_spawn_count, game->commands.dropped_command_count);
+
+	free(frame_ms);
+
+	if (game->profiler.csv)
+		fclose(game->profiler.csv);
+
+	if (end_checksum_stream(checksums))
+		return 8;
+
+	return 0;
+}
+
+static void
+mix_sounds_sample_major(struct game_state *game, f32 global_t, f32 *out, u32 count)
+{
+	/* NOTE(omid): The previous per-sample loop, kept as the baseline for
+	 * --bench-mixer. */
+	for (u32 i = 0; i < count; ++i) {
+		f32 mix = 0;
+		for (u32 sound_index = 0; sound_index < game->sound_count; ++sound_index) {
+			struct sound *sound = game->sounds + sound_index;
+			if (sound->play_begin > global_t)
+				continue;
+
+			f32 w = 0;
+			switch (sound->type) {
+			case SINE:
+				w = sample_sine_table(game->sine_table, sound->phase) * sound->wave.amp;
+				sound->phase += sound->phase_step;
+				break;
+
+			case SAW:
+				w = saw_from_phase(sound->phase) * sound->wave.amp;
+				sound->phase += sound->phase_step;
+				break;
+
+			case WHITENOISE:
+				w = sound->wave.amp * next_noise_sample(&sound->random);
+				break;
+			}
+
+			mix += w;
+		}
+
+		if (mix < -1.0f)
+			mix = -1.0f;
+		else if (mix > 1.0f)
+			mix = 1.0f;
+
+		out[i] = mix;
+	}
+}
+
+static f64
+bench_mixer_path(struct game_state *game, const struct sound *voices, u32 voice_count, u32 buffer_count, u32 path, f32 *out)
+{
+	f32 accum[AUDIO_SAMPLE_COUNT];
+
+	memcpy(game->sounds, voices, sizeof(struct sound) * voice_count);
+	game->sound_count = voice_count;
+
+	u64 begin = SDL_GetPerformanceCounter();
+	for (u32 i = 0; i < buffer_count; ++i) {
+		switch (path) {
+		case 0:
+			mix_sounds_sample_major(game, 0, out, AUDIO_SAMPLE_COUNT);
+			break;
+
+		case 1:
+			mix_sounds_scalar(game, 0, accum, AUDIO_SAMPLE_COUNT);
+			clamp_mix_scalar(accum, out, AUDIO_SAMPLE_COUNT);
+			break;
+
+#if defined(__SSE2__)
+		case 2:
+			mix_sounds_sse2(game, 0, accum, AUDIO_SAMPLE_COUNT);
+			clamp_mix_sse2(accum, out, AUDIO_SAMPLE_COUNT);
+			break;
+#endif
+		}
+	}
+
+	return (f64)(SDL_GetPerformanceCounter() - begin) * 1000.0 / (f64)SDL_GetPerformanceFrequency() / buffer_count;
+}
+
+static f32
+max_abs_diff(const f32 *a, const f32 *b, u32 count)
+{
+	f32 result = 0;
+	for (u32 i = 0; i < count; ++i) {
+		f32 diff = fabsf(a[i] - b[i]);
+		if (diff > result)
+			result = diff;
+	}
+	return result;
+}
+
+static s32
+run_mixer_benchmark(void)
+{
+	static const u32 voice_counts[] = { 16, 64, 256, 1024 };
+	static const char *path_names[] = { "sample-major", "block scalar", "block sse2" };
+	const u32 buffer_count = 200;
+
+	struct game_state *game = (struct game_state *)malloc(sizeof(struct game_state));
+	struct sound *voices = malloc(sizeof(struct sound) * 1024);
+	if (!game || !voices)
+		return 4;
+
+	ZERO_STRUCT(*game);
+	init_sine_table(game->sine_table);
+	struct random_series series = random_series_from_seed(1);
+
+	/* NOTE(omid): Sines and saws only; white noise is the same scalar
+	 * loop in every path. */
+	for (u32 i = 0; i < ARRAY_COUNT(voice_counts); ++i) {
+		u32 voice_count = voice_counts[i];
+
+		game->sound_count = 0;
+		for (u32 j = 0; j < voice_count; ++j)
+			push_sound(game, (j & 1) ? SAW : SINE, (u16)random_int(&series, 40, 2000), 2.0f / (f32)voice_count);
+		memcpy(voices, game->sounds, sizeof(struct sound) * voice_count);
+
+		f32 reference[AUDIO_SAMPLE_COUNT];
+		f32 out[AUDIO_SAMPLE_COUNT];
+		f64 reference_ms = bench_mixer_path(game, voices, voice_count, buffer_count, 0, reference);
+
+		printf("mixer: %4u voices, %s %.4f ms/buffer\n", voice_count, path_names[0], reference_ms);
+
+#if defined(__SSE2__)
+		u32 path_count = 3;
+#else
+		u32 path_count = 2;
+#endif
+		for (u32 path = 1; path < path_count; ++path) {
+			f64 ms = bench_mixer_path(game, voices, voice_count, buffer_count, path, out);
+			printf("mixer: %4u voices, %s %.4f ms/buffer (%.1fx, max diff %g)\n",
+			       voice_count, path_names[path], ms, reference_ms / ms, (f64)max_abs_diff(reference, out, AUDIO_SAMPLE_COUNT));
+		}
+	}
+
+	free(voices);
+	free(game);
+	return 0;
+}
+
+static s32
+run_fft_benchmark(void)
+{
+	const u32 iteration_count = 2000;
+
+	struct fft_tables *tables = malloc(sizeof(struct fft_tables));
+	f64 *reference = malloc(sizeof(f64) * (FFT_SIZE / 2 + 1));
+	if (!tables || !reference)
+		return 4;
+
+	init_fft_tables(tables);
+	struct random_series series = random_series_from_seed(1);
+
+	f32 signal[FFT_SIZE];
+	for (u32 i = 0; i < FFT_SIZE; ++i) {
+		f32 t = (f32)i / AUDIO_FREQ;
+		signal[i] = 0.5f * sinf(2 * 3.14159265f * 440 * t) + 0.25f * sinf(2 * 3.14159265f * 3000 * t) + 0.1f * (2 * random_f32(&series) - 1);
+	}
+
+	/* NOTE(omid): Direct DFT in double as the accuracy reference. */
+	for (u32 k = 0; k <= FFT_SIZE / 2; ++k) {
+		f64 re = 0, im = 0;
+		for (u32 i = 0; i < FFT_SIZE; ++i) {
+			f64 a = 2.0 * 3.14159265358979 * (f64)((k * i) % FFT_SIZE) / FFT_SIZE;
+			re += signal[i] * cos(a);
+			im -= signal[i] * sin(a);
+		}
+		reference[k] = sqrt(re * re + im * im);
+	}
+
+	f64 counter_to_ms = 1000.0 / (f64)SDL_GetPerformanceFrequency();
+
+	double complex buf[FFT_SIZE];
+	double complex tmp[FFT_SIZE];
+	u64 begin = SDL_GetPerformanceCounter();
+	for (u32 n = 0; n < iteration_count; ++n) {
+		for (u32 i = 0; i < FFT_SIZE; ++i)
+			buf[i] = signal[i];
+		fft(buf, tmp, FFT_SIZE);
+	}
+	f64 complex_ms = (f64)(SDL_GetPerformanceCounter() - begin) * counter_to_ms / iteration_count;
+
+	f32 data[FFT_SIZE];
+	begin = SDL_GetPerformanceCounter();
+	for (u32 n = 0; n < iteration_count; ++n) {
+		memcpy(data, signal, sizeof(data));
+		real_fft(tables, data);
+	}
+	f64 real_ms = (f64)(SDL_GetPerformanceCounter() - begin) * counter_to_ms / iteration_count;
+
+	f64 complex_error = 0, real_error = 0;
+	for (u32 k = 0; k <= FFT_SIZE / 2; ++k) {
+		complex_error = fmax(complex_error, fabs(cabs(buf[k]) - reference[k]));
+		real_error = fmax(real_error, fabs((f64)real_fft_magnitude(data, k) - reference[k]));
+	}
+
+	printf("fft: %u samples, fft() %.4f ms, real_fft %.4f ms (%.1fx)\n", FFT_SIZE, complex_ms, real_ms, complex_ms / real_ms);
+	printf("fft: max bin magnitude error vs direct DFT, fft() %g, real_fft %g\n", complex_error, real_error);
+
+	free(reference);
+	free(tables);
+	return 0;
+}
+
+static s32
+run_particle_benchmark(void)
+{
+	const u32 frame_count = 200;
+
+	struct game_state *game = (struct game_state *)malloc(sizeof(struct game_state));
+	SDL_Vertex *reference = malloc(sizeof(SDL_Vertex) * MAX_PARTICLE_COUNT * 4);
+	if (!game || !reference)
+		return 4;
+
+	ZERO_STRUCT(*game);
+	struct random_series series = random_series_from_seed(1);
+
+	/* NOTE(omid): Stress scene, the particle store filled with
+	 * spawn_explosion bursts of 200 scattered over the screen, half way
+	 * through their life so alpha varies, spinning at random angles. */
+	struct entity_part_owner owner = { 0 };
+	while (game->particles.count < MAX_PARTICLE_COUNT) {
+		struct v2 location = v2(random_f32(&series) * WINDOW_WIDTH, random_f32(&series) * WINDOW_HEIGHT);
+		spawn_explosion(game, &series, owner, (u8)random_int(&series, 1, 8), location, 200);
+	}
+	game->time = 0.5f;
+
+	f64 counter_to_ms = 1000.0 / (f64)SDL_GetPerformanceFrequency();
+	struct particle_quads *quads = &particle_quads;
+	f64 gather_ms = 0, scalar_ms = 0, sse2_ms = 0;
+	f32 max_diff = 0;
+
+	for (u32 frame = 0; frame < frame_count; ++frame) {
+		for (u32 i = 0; i < game->particles.count; ++i)
+			game->particles.info[i].angle = random_f32(&series) * 2 * 3.14159265f;
+
+		u64 begin = SDL_GetPerformanceCounter();
+		gather_particle_quads(game, quads);
+		gather_ms += (f64)(SDL_GetPerformanceCounter() - begin) * counter_to_ms;
+
+		begin = SDL_GetPerformanceCounter();
+		build_particle_quads_scalar(quads);
+		scalar_ms += (f64)(SDL_GetPerformanceCounter() - begin) * counter_to_ms;
+
+#if defined(__SSE2__)
+		memcpy(reference, quads->vertices, sizeof(SDL_Vertex) * quads->count * 4);
+
+		begin = SDL_GetPerformanceCounter();
+		build_particle_quads_sse2(quads);
+		sse2_ms += (f64)(SDL_GetPerformanceCounter() - begin) * counter_to_ms;
+
+		for (u32 i = 0; i < quads->count * 4; ++i) {
+			f32 dx = fabsf(reference[i].position.x - quads->vertices[i].position.x);
+			f32 dy = fabsf(reference[i].position.y - quads->vertices[i].position.y);
+			if (dx > max_diff)
+				max_diff = dx;
+			if (dy > max_diff)
+				max_diff = dy;
+			if (memcmp(&reference[i].color, &quads->vertices[i].color, sizeof(SDL_Color)) != 0)
+				max_diff = INFINITY;
+		}
+#endif
+	}
+
+	printf("particles: %u live, 1 geometry call per frame instead of %u copies\n", quads->count, quads->count);
+	printf("particles: gather %.4f ms/frame, quads scalar %.4f ms/frame\n", gather_ms / frame_count, scalar_ms / frame_count);
+#if defined(__SSE2__)
+	printf("particles: quads sse2 %.4f ms/frame (%.1fx, max diff %g)\n", sse2_ms / frame_count, scalar_ms / sse2_ms, (f64)max_diff);
+#endif
+
+	free(reference);
+	free(game);
+	return 0;
+}
+
 int
-main()
+main(int argc, char **argv)
 {
+	b32 headless = false;
+	u32 headless_frame_count = 0;
+	u32 seed = 0;
+	b32 has_seed = false;
+	const char *profile_csv = 0;
+	const char *record_filename = 0;
+	const char *replay_filename = 0;
+	const char *checksum_filename = 0;
+	const char *checksum_reference_filename = 0;
+	u32 checksum_interval = 1;
+	u32 thread_count = 0;
+	b32 bench_mixer = false;
+	b32 bench_fft = false;
+	b32 bench_particles = false;
+
+	for (s32 i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--headless") == 0 && i + 1 < argc) {
+			headless = true;
+			headless_frame_count = (u32)strtoul(argv[++i], 0, 10);
+		} else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			seed = (u32)strtoul(argv[++i], 0, 10);
+			has_seed = true;
+		} else if (strcmp(argv[i], "--profile-csv") == 0 && i + 1 < argc) {
+			profile_csv = argv[++i];
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			record_filename = argv[++i];
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replay_filename = argv[++i];
+		} else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			thread_count = (u32)strtoul(argv[++i], 0, 10);
+		} else if (strcmp(argv[i], "--checksum") == 0 && i + 1 < argc) {
+			checksum_filename = argv[++i];
+		} else if (strcmp(argv[i], "--checksum-every") == 0 && i + 1 < argc) {
+			checksum_interval = (u32)strtoul(argv[++i], 0, 10);
+		} else if (strcmp(argv[i], "--checksum-reference") == 0 && i + 1 < argc) {
+			checksum_reference_filename = argv[++i];
+		} else if (strcmp(argv[i], "--bench-mixer") == 0) {
+			bench_mixer = true;
+		} else if (strcmp(argv[i], "--bench-fft") == 0) {
+			bench_fft = true;
+		} else if (strcmp(argv[i], "--bench-particles") == 0) {
+			bench_particles = true;
+		} else {
+			fprintf(stderr, "usage: %s [--headless FRAMES] [--seed SEED] [--profile-csv FILE] [--threads N] [--record FILE] [--replay FILE] [--checksum FILE] [--checksum-every N] [--checksum-reference FILE] [--bench-mixer] [--bench-fft] [--bench-particles]\n", argv[0]);
+			return 5;
+		}
+	}
+
+	if (bench_mixer)
+		return run_mixer_benchmark();
+
+	if (bench_fft)
+		return run_fft_benchmark();
+
+	if (bench_particles)
+		return run_particle_benchmark();
+
+	if (replay_filename) {
+		if (!load_replay(&replay, replay_filename)) {
+			fprintf(stderr, "could not load replay '%s'\n", replay_filename);
+			return 7;
+		}
+		seed = replay.seed;
+		has_seed = true;
+	}
+
+	if (!begin_checksum_stream(&checksum_stream, checksum_filename, checksum_reference_filename, checksum_interval))
+		return 9;
+
+	init_job_system(&job_system, thread_count ? thread_count : (u32)SDL_GetCPUCount());
+
+	if (headless) {
+		/* NOTE(omid): A replay runs to its end unless FRAMES is shorter. */
+		u32 frame_count = headless_frame_count;
+		if (replay.frames && (!frame_count || frame_count > replay.frame_count))
+			frame_count = replay.frame_count;
+		if (!frame_count)
+			return 5;
+
+		if (!has_seed)
+			seed = 1;
+		if (record_filename && !begin_replay_recording(&replay, record_filename, seed))
+			return 7;
+
+		s32 result = run_headless(frame_count, seed, profile_csv, &replay, &checksum_stream);
+		end_replay(&replay);
+		shutdown_job_system(&job_system);
+		return result;
+	}
+
 	if (SDL_Init(SDL_INIT_VIDEO) < 0)
 		return 1;
 
 	if (TTF_Init() < 0)
 		return 2;
 
-#if defined(__EMSCRIPTEN__)
-	srand(emscripten_random() * RAND_MAX);
-#else
-	srand((u32)time(0));
-#endif
-
 	window_w = WINDOW_WIDTH;
 	window_h = WINDOW_HEIGHT;
 
@@ -3918,16 +7738,23 @@ main()
 	font_name = "novem___.ttf";
 	font = TTF_OpenFont(font_name, FONT_SIZE);
 	small_font = TTF_OpenFont(font_name, SMALL_FONT_SIZE);
+	build_glyph_atlas(renderer, font);
+	build_glyph_atlas(renderer, small_font);
 
-	global_game = (struct game_state *)malloc(sizeof(struct game_state));
-	ZERO_STRUCT(*global_game);
-	/* game->level_end_t = -5; */
-	goto_level(global_game, 0);
+	if (!has_seed)
+#if defined(__EMSCRIPTEN__)
+		seed = (u32)(emscripten_random() * RAND_MAX);
+#else
+		seed = (u32)time(0);
+#endif
+
+	if (record_filename && !begin_replay_recording(&replay, record_filename, seed))
+		return 7;
 
-	load_track(global_game, "track.imm");
-	load_track(global_game, "track-2.imm");
-	load_track(global_game, "track-3.imm")->tempo_inverse_scale = 600;
-	load_track(global_game, "track-4.imm");
+	global_game = create_game_state(seed);
+
+	if (profile_csv && !open_profile_csv(&global_game->profiler, profile_csv))
+		return 6;
 
 	ZERO_STRUCT(input);
 
@@ -3963,7 +7790,14 @@ main()
 
 	SDL_CloseAudio();
 
+	if (global_game->profiler.csv)
+		fclose(global_game->profiler.csv);
+
+	end_replay(&replay);
+	end_checksum_stream(&checksum_stream);
+	shutdown_job_system(&job_system);
 
+	destroy_glyph_atlases();
 	TTF_CloseFont(font);
 	SDL_DestroyRenderer(renderer);
 	SDL_Quit();